@@ -0,0 +1,55 @@
+// SPDX-FileCopyrightText: 2026 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "chunkedtimeline.h"
+
+using namespace Quotient;
+
+TimelineItem& ChunkedTimeline::emplace_back(RoomEventPtr&& event)
+{
+    const auto chunkNo = chunkNumber(endIdx);
+    if (chunks.empty())
+        firstChunk = chunkNo;
+    if (size_type(chunkNo - firstChunk) == chunks.size())
+        chunks.push_back(std::make_unique_for_overwrite<Chunk>());
+    auto* const item = new (itemAt(endIdx)) TimelineItem(std::move(event), endIdx);
+    ++endIdx;
+    return *item;
+}
+
+TimelineItem& ChunkedTimeline::emplace_front(RoomEventPtr&& event)
+{
+    const auto index = beginIdx - 1;
+    const auto chunkNo = chunkNumber(index);
+    if (chunks.empty()) {
+        firstChunk = chunkNo;
+        chunks.push_back(std::make_unique_for_overwrite<Chunk>());
+    } else if (chunkNo < firstChunk) {
+        chunks.push_front(std::make_unique_for_overwrite<Chunk>());
+        --firstChunk;
+    }
+    auto* const item = new (itemAt(index)) TimelineItem(std::move(event), index);
+    beginIdx = index;
+    return *item;
+}
+
+ChunkedTimeline::size_type ChunkedTimeline::unloadBefore(index_t index)
+{
+    const auto oldSize = size();
+    for (index = std::min(index, endIdx); beginIdx < index; ++beginIdx) {
+        std::destroy_at(itemAt(beginIdx));
+        if (chunkNumber(beginIdx + 1) != firstChunk) { // The chunk is now empty
+            chunks.pop_front();
+            ++firstChunk;
+        }
+    }
+    return oldSize - size();
+}
+
+void ChunkedTimeline::clear()
+{
+    for (auto index = beginIdx; index < endIdx; ++index)
+        std::destroy_at(itemAt(index));
+    chunks.clear();
+    firstChunk = beginIdx = endIdx = 0;
+}
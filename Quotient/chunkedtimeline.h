@@ -0,0 +1,217 @@
+// SPDX-FileCopyrightText: 2026 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "eventitem.h"
+
+#include <compare>
+#include <deque>
+#include <iterator>
+#include <memory>
+#include <new>
+
+namespace Quotient {
+
+//! \brief The storage of room timeline items
+//!
+//! This is a sequence container of TimelineItem objects, addressed by their
+//! timeline indices: items appended to the back get increasing indices, while
+//! items prepended to the front (historical events) get decreasing ones; an
+//! item keeps its index for as long as it stays in the container. Items are
+//! stored in fixed-size chunks, each covering a fixed range of indices, so
+//! that adding items at either end never moves the items already stored and
+//! doesn't invalidate iterators (unlike with `std::deque`).
+//!
+//! Older items can be unloaded from memory with unloadBefore(), releasing
+//! the chunks that become empty; the indices of the remaining items don't
+//! change, and items added to the front after that get the same indices
+//! the unloaded items had.
+//!
+//! The container provides most of the `std::deque` interface used with the room
+//! timeline before; indices passed to operator[]() are counted from the front,
+//! as before, while at() takes a timeline index.
+class QUOTIENT_API ChunkedTimeline {
+public:
+    using value_type = TimelineItem;
+    using index_t = TimelineItem::index_t;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = TimelineItem&;
+    using const_reference = const TimelineItem&;
+
+    //! \brief The number of items in a chunk
+    //!
+    //! Most rooms only have a few dozen events loaded at any time, so chunks
+    //! are kept small enough to not waste much memory on the unused part.
+    static constexpr index_t ChunkSize = 32;
+
+    template <bool IsConst>
+    class Iterator {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = TimelineItem;
+        using difference_type = std::ptrdiff_t;
+        using reference = std::conditional_t<IsConst, const TimelineItem&, TimelineItem&>;
+        using pointer = std::conditional_t<IsConst, const TimelineItem*, TimelineItem*>;
+
+        Iterator() = default;
+        // Allow conversion from a non-const iterator to a const one
+        template <bool OtherConst>
+            requires(IsConst && !OtherConst)
+        Iterator(const Iterator<OtherConst>& other)
+            : container(other.container), idx(other.idx)
+        {}
+
+        reference operator*() const { return *container->itemAt(idx); }
+        pointer operator->() const { return container->itemAt(idx); }
+        reference operator[](difference_type n) const
+        {
+            return *container->itemAt(index_t(idx + n));
+        }
+
+        Iterator& operator++() { ++idx; return *this; }
+        Iterator operator++(int) { auto it = *this; ++idx; return it; }
+        Iterator& operator--() { --idx; return *this; }
+        Iterator operator--(int) { auto it = *this; --idx; return it; }
+        Iterator& operator+=(difference_type n) { idx = index_t(idx + n); return *this; }
+        Iterator& operator-=(difference_type n) { idx = index_t(idx - n); return *this; }
+        friend Iterator operator+(Iterator it, difference_type n) { return it += n; }
+        friend Iterator operator+(difference_type n, Iterator it) { return it += n; }
+        friend Iterator operator-(Iterator it, difference_type n) { return it -= n; }
+        friend difference_type operator-(const Iterator& lhs, const Iterator& rhs)
+        {
+            return difference_type(lhs.idx) - rhs.idx;
+        }
+
+        friend bool operator==(const Iterator& lhs, const Iterator& rhs)
+        {
+            return lhs.idx == rhs.idx;
+        }
+        friend std::strong_ordering operator<=>(const Iterator& lhs, const Iterator& rhs)
+        {
+            return lhs.idx <=> rhs.idx;
+        }
+
+    private:
+        friend class ChunkedTimeline;
+        friend class Iterator<!IsConst>;
+
+        const ChunkedTimeline* container = nullptr;
+        index_t idx = 0;
+
+        Iterator(const ChunkedTimeline* c, index_t index) : container(c), idx(index) {}
+    };
+
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    ChunkedTimeline() = default;
+    ChunkedTimeline(ChunkedTimeline&& other) noexcept
+        : chunks(std::move(other.chunks))
+        , firstChunk(std::exchange(other.firstChunk, 0))
+        , beginIdx(std::exchange(other.beginIdx, 0))
+        , endIdx(std::exchange(other.endIdx, 0))
+    {}
+    ChunkedTimeline& operator=(ChunkedTimeline&& other) noexcept
+    {
+        if (this != &other) {
+            clear();
+            chunks = std::move(other.chunks);
+            firstChunk = std::exchange(other.firstChunk, 0);
+            beginIdx = std::exchange(other.beginIdx, 0);
+            endIdx = std::exchange(other.endIdx, 0);
+        }
+        return *this;
+    }
+    ~ChunkedTimeline() { clear(); }
+
+    bool empty() const { return beginIdx == endIdx; }
+    size_type size() const { return size_type(endIdx - beginIdx); }
+
+    //! The index of the first (oldest) item
+    index_t firstIndex() const { return beginIdx; }
+    //! The index the next item appended to the back will have
+    index_t endIndex() const { return endIdx; }
+    bool containsIndex(index_t index) const { return index >= beginIdx && index < endIdx; }
+
+    //! Get the item at position \p pos counted from the front
+    TimelineItem& operator[](size_type pos) { return *itemAt(index_t(beginIdx + pos)); }
+    const TimelineItem& operator[](size_type pos) const
+    {
+        return *itemAt(index_t(beginIdx + pos));
+    }
+    //! Get the item with timeline index \p index; the index must be in the container
+    TimelineItem& at(index_t index)
+    {
+        Q_ASSERT(containsIndex(index));
+        return *itemAt(index);
+    }
+    const TimelineItem& at(index_t index) const
+    {
+        Q_ASSERT(containsIndex(index));
+        return *itemAt(index);
+    }
+    TimelineItem& front() { return at(beginIdx); }
+    const TimelineItem& front() const { return at(beginIdx); }
+    TimelineItem& back() { return at(endIdx - 1); }
+    const TimelineItem& back() const { return at(endIdx - 1); }
+
+    iterator begin() { return { this, beginIdx }; }
+    iterator end() { return { this, endIdx }; }
+    const_iterator begin() const { return { this, beginIdx }; }
+    const_iterator end() const { return { this, endIdx }; }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+    const_reverse_iterator crbegin() const { return rbegin(); }
+    const_reverse_iterator crend() const { return rend(); }
+
+    //! Add an item with \p event to the back, with the index endIndex()
+    TimelineItem& emplace_back(RoomEventPtr&& event);
+    //! Add an item with \p event to the front, with the index <tt>firstIndex() - 1</tt>
+    TimelineItem& emplace_front(RoomEventPtr&& event);
+
+    //! \brief Remove items with indices below \p index from the front
+    //!
+    //! Chunks that have no items left get released.
+    //! \return the number of items removed from the container
+    size_type unloadBefore(index_t index);
+
+    //! Remove all items and start indexing from 0 again
+    void clear();
+
+private:
+    struct Chunk {
+        alignas(TimelineItem) std::byte storage[ChunkSize * sizeof(TimelineItem)];
+
+        TimelineItem* slot(index_t offset)
+        {
+            return std::launder(reinterpret_cast<TimelineItem*>(storage) + offset);
+        }
+    };
+
+    std::deque<std::unique_ptr<Chunk>> chunks;
+    //! The number of the chunk at the front of `chunks`
+    index_t firstChunk = 0;
+    index_t beginIdx = 0;
+    index_t endIdx = 0;
+
+    static index_t chunkNumber(index_t index)
+    {
+        return index >= 0 ? index / ChunkSize : -((-index - 1) / ChunkSize) - 1;
+    }
+
+    TimelineItem* itemAt(index_t index) const
+    {
+        const auto chunkNo = chunkNumber(index);
+        return chunks[size_type(chunkNo - firstChunk)]->slot(index - chunkNo * ChunkSize);
+    }
+};
+
+} // namespace Quotient
@@ -41,8 +41,10 @@
 #include <QtCore/QDir>
 #include <QtCore/QElapsedTimer>
 #include <QtCore/QFile>
+#include <QtCore/QFileInfo>
 #include <QtCore/QMimeDatabase>
 #include <QtCore/QRegularExpression>
+#include <QtCore/QSaveFile>
 #include <QtCore/QStandardPaths>
 #include <QtCore/QStringBuilder>
 #include <QtNetwork/QDnsLookup>
@@ -72,6 +74,10 @@ Connection::Connection(const QUrl& server, QObject* parent)
     //connect(qApp, &QCoreApplication::aboutToQuit, this, &Connection::saveOlmAccount);
     d->q = this; // All d initialization should occur before this line
     setObjectName(server.toString());
+    connect(this, &Connection::accountDataChanged, this, [this](const QString& type) {
+        if (type == PushRulesEventType)
+            d->pushRuleEvaluator.reset();
+    });
 }
 
 Connection::Connection(QObject* parent) : Connection({}, parent) {}
@@ -631,9 +637,10 @@ void Connection::Private::consumeToDeviceEvents(Events&& toDeviceEvents)
         return;
 
     qCDebug(E2EE) << "Consuming" << toDeviceEvents.size() << "to-device events";
-    for (auto&& tdEvt : std::move(toDeviceEvents)) {
-        if (encryptionData)
-            encryptionData->consumeToDeviceEvent(std::move(tdEvt));
+    if (encryptionData) {
+        encryptionData->consumeToDeviceEvents(std::move(toDeviceEvents));
+        encryptionData->saveOlmSessionsLastReceived();
+        encryptionData->trimOlmSessions();
     }
 }
 
@@ -1433,25 +1440,76 @@ QFuture<QList<LoginFlow>> Connection::setHomeserver(const QUrl& baseUrl)
     return d->loginFlowsJob.responseFuture();
 }
 
+// A room cache journal is merged into the room cache file once the journal
+// grows beyond this size or a half of the room cache file, whichever is larger
+constexpr qint64 MinCacheJournalSizeToCompact = 64 * 1024;
+
 void Connection::saveRoomState(Room* r) const
 {
     Q_ASSERT(r);
     if (!d->cacheState)
         return;
 
-    QFile outRoomFile { stateCacheDir().filePath(
-        SyncData::fileNameForRoom(r->id())) };
-    if (outRoomFile.open(QFile::WriteOnly)) {
-        const auto data =
-            d->cacheToBinary
-                ? QCborValue::fromJsonValue(r->toJson()).toCbor()
-                : QJsonDocument(r->toJson()).toJson(QJsonDocument::Compact);
-        outRoomFile.write(data.data(), data.size());
-        qCDebug(MAIN) << "Room state cache saved to" << outRoomFile.fileName();
-    } else {
-        qCWarning(MAIN) << "Error opening" << outRoomFile.fileName() << ":"
-                        << outRoomFile.errorString();
+    const auto roomFileName = stateCacheDir().filePath(SyncData::fileNameForRoom(r->id()));
+    const auto journalFileName = SyncData::journalFileName(roomFileName);
+    auto journalSizeIt = d->roomCacheJournalSizes.find(r->id());
+    if (journalSizeIt == d->roomCacheJournalSizes.end() && QFile::exists(roomFileName))
+        journalSizeIt = d->roomCacheJournalSizes.insert(r->id(), QFileInfo(journalFileName).size());
+
+    if (auto delta = r->takeCacheDelta();
+        delta && journalSizeIt != d->roomCacheJournalSizes.end()
+        && *journalSizeIt < std::max(MinCacheJournalSizeToCompact,
+                                     QFileInfo(roomFileName).size() / 2)) {
+        // Only append what has changed since the previous save
+        QByteArray entry = QJsonDocument(*delta).toJson(QJsonDocument::Compact) + '\n';
+        *journalSizeIt += entry.size();
+        d->cacheWriter.start([journalFileName, entry = std::move(entry)] {
+            QFile journalFile { journalFileName };
+            if (!journalFile.open(QFile::WriteOnly | QFile::Append)) {
+                qCWarning(MAIN) << "Error opening" << journalFile.fileName() << ":"
+                                << journalFile.errorString();
+                return;
+            }
+            journalFile.write(entry);
+        });
+        return;
     }
+
+    // (Re)write the room cache file, with the journal merged into it
+    d->roomCacheJournalSizes.insert(r->id(), 0);
+    d->cacheWriter.start([roomFileName, journalFileName, json = r->toJson(),
+                          toBinary = d->cacheToBinary] {
+        QSaveFile outRoomFile { roomFileName };
+        if (!outRoomFile.open(QFile::WriteOnly)) {
+            qCWarning(MAIN) << "Error opening" << outRoomFile.fileName() << ":"
+                            << outRoomFile.errorString();
+            return;
+        }
+        const auto data = toBinary ? QCborValue::fromJsonValue(json).toCbor()
+                                   : QJsonDocument(json).toJson(QJsonDocument::Compact);
+        outRoomFile.write(data.data(), data.size());
+        // The journal only applies to the file it was written after; move it
+        // aside before replacing that file so that it's never replayed on top
+        // of the new one. If the client stops between the two renames, the
+        // changes from the journal are lost, leaving an older room state
+        const auto oldJournalFileName = journalFileName + ".old"_ls;
+        QFile::remove(oldJournalFileName);
+        if (QFile::exists(journalFileName)
+            && !QFile::rename(journalFileName, oldJournalFileName)) {
+            qCWarning(MAIN) << "Error moving" << journalFileName << "aside, not saving"
+                            << roomFileName;
+            return; // outRoomFile is discarded
+        }
+        if (!outRoomFile.commit()) {
+            qCWarning(MAIN) << "Error saving" << outRoomFile.fileName() << ":"
+                            << outRoomFile.errorString();
+            // The journal still applies to the old file
+            QFile::rename(oldJournalFileName, journalFileName);
+            return;
+        }
+        QFile::remove(oldJournalFileName);
+        qCDebug(MAIN) << "Room state cache saved to" << roomFileName;
+    });
 }
 
 void Connection::saveState() const
@@ -1459,6 +1517,9 @@ void Connection::saveState() const
     if (!d->cacheState)
         return;
 
+    // Make sure that room cache files are not behind the top-level one
+    d->cacheWriter.waitForDone();
+
     QElapsedTimer et;
     et.start();
 
@@ -1483,10 +1544,11 @@ void Connection::saveState() const
         for (const auto* r: std::as_const(d->roomMap)) {
             if (r->joinState() == JoinState::Leave)
                 continue;
+            QJsonObject roomRef { { "$ref"_ls, SyncData::fileNameForRoom(r->id()) } };
+            if (auto roomIndex = r->toCacheIndexJson(); !roomIndex.isEmpty())
+                roomRef.insert("index"_ls, roomIndex);
             (r->joinState() == JoinState::Invite ? inviteRoomsJson : roomsJson)
-                .insert(r->id(),
-                        QJsonObject{ { "$ref"_ls,
-                                       SyncData::fileNameForRoom(r->id()) } });
+                .insert(r->id(), roomRef);
         }
 
         QJsonObject roomObj;
@@ -1533,7 +1595,7 @@ void Connection::loadState()
     QElapsedTimer et;
     et.start();
 
-    SyncData sync { d->topLevelStatePath() };
+    SyncData sync { d->topLevelStatePath(), d->lazyCacheLoading };
     if (sync.nextBatch().isEmpty()) // No token means no cache by definition
         return;
 
@@ -1580,6 +1642,66 @@ void Connection::setLazyLoading(bool newValue)
     }
 }
 
+bool Connection::lazyCacheLoading() const { return d->lazyCacheLoading; }
+
+void Connection::setLazyCacheLoading(bool newValue)
+{
+    if (d->lazyCacheLoading != newValue) {
+        d->lazyCacheLoading = newValue;
+        emit lazyCacheLoadingChanged();
+    }
+}
+
+bool Connection::compactEventStorage() const { return d->compactEventStorage; }
+
+void Connection::setCompactEventStorage(bool newValue)
+{
+    if (d->compactEventStorage != newValue) {
+        d->compactEventStorage = newValue;
+        emit compactEventStorageChanged();
+    }
+}
+
+int Connection::maxResidentOlmSessions() const { return d->maxResidentOlmSessions; }
+
+void Connection::setMaxResidentOlmSessions(int newValue)
+{
+    if (d->maxResidentOlmSessions != newValue) {
+        d->maxResidentOlmSessions = newValue;
+        emit maxResidentOlmSessionsChanged();
+    }
+}
+
+int Connection::maxOlmSessionsPerSender() const { return d->maxOlmSessionsPerSender; }
+
+void Connection::setMaxOlmSessionsPerSender(int newValue)
+{
+    if (d->maxOlmSessionsPerSender != newValue) {
+        d->maxOlmSessionsPerSender = newValue;
+        emit maxOlmSessionsPerSenderChanged();
+    }
+}
+
+int Connection::maxResidentRoomEvents() const { return d->maxResidentRoomEvents; }
+
+void Connection::setMaxResidentRoomEvents(int newValue)
+{
+    if (d->maxResidentRoomEvents != newValue) {
+        d->maxResidentRoomEvents = newValue;
+        emit maxResidentRoomEventsChanged();
+    }
+}
+
+StringPool& Connection::stringPool() { return d->stringPool; }
+
+const PushRuleEvaluator& Connection::pushRuleEvaluator() const
+{
+    if (!d->pushRuleEvaluator)
+        d->pushRuleEvaluator.emplace(
+            PushRuleEvaluator::fromAccountData(accountDataJson(PushRulesEventType)));
+    return *d->pushRuleEvaluator;
+}
+
 BaseJob* Connection::run(BaseJob* job, RunningPolicy runningPolicy)
 {
     // Reparent to protect from #397, #398 and to prevent BaseJob* from being
@@ -52,6 +52,7 @@ class SendToDeviceJob;
 class SendMessageJob;
 class LeaveRoomJob;
 class Database;
+class PushRuleEvaluator;
 struct EncryptedFileMetadata;
 
 class QOlmAccount;
@@ -128,9 +129,14 @@ class QUOTIENT_API Connection : public QObject {
     Q_PROPERTY(bool supportsPasswordAuth READ supportsPasswordAuth NOTIFY loginFlowsChanged STORED false)
     Q_PROPERTY(bool cacheState READ cacheState WRITE setCacheState NOTIFY cacheStateChanged)
     Q_PROPERTY(bool lazyLoading READ lazyLoading WRITE setLazyLoading NOTIFY lazyLoadingChanged)
+    Q_PROPERTY(bool lazyCacheLoading READ lazyCacheLoading WRITE setLazyCacheLoading NOTIFY lazyCacheLoadingChanged)
+    Q_PROPERTY(bool compactEventStorage READ compactEventStorage WRITE setCompactEventStorage NOTIFY compactEventStorageChanged)
     Q_PROPERTY(bool canChangePassword READ canChangePassword NOTIFY capabilitiesLoaded)
     Q_PROPERTY(bool encryptionEnabled READ encryptionEnabled WRITE enableEncryption NOTIFY encryptionChanged)
     Q_PROPERTY(bool directChatEncryptionEnabled READ directChatEncryptionEnabled WRITE enableDirectChatEncryption NOTIFY directChatsEncryptionChanged)
+    Q_PROPERTY(int maxResidentOlmSessions READ maxResidentOlmSessions WRITE setMaxResidentOlmSessions NOTIFY maxResidentOlmSessionsChanged)
+    Q_PROPERTY(int maxOlmSessionsPerSender READ maxOlmSessionsPerSender WRITE setMaxOlmSessionsPerSender NOTIFY maxOlmSessionsPerSenderChanged)
+    Q_PROPERTY(int maxResidentRoomEvents READ maxResidentRoomEvents WRITE setMaxResidentRoomEvents NOTIFY maxResidentRoomEventsChanged)
     Q_PROPERTY(QStringList accountDataEventTypes READ accountDataEventTypes NOTIFY accountDataChanged)
 
 public:
@@ -467,7 +473,12 @@ public:
     //! \sa loadState
     Q_INVOKABLE void saveState() const;
 
-    //! This method saves the current state of a single room.
+    //! \brief Save the current state of a single room
+    //!
+    //! Normally, only what has changed since the previous save is appended to
+    //! the room's cache journal; once the journal grows big enough, the room
+    //! cache file is rewritten entirely. The actual writing happens in
+    //! a background thread; saveState() waits until it's done.
     void saveRoomState(Room* r) const;
 
     //! \brief Get the default directory path to save the room state to
@@ -494,6 +505,73 @@ public:
     bool lazyLoading() const;
     void setLazyLoading(bool newValue);
 
+    //! \brief Whether room cache files should only be loaded when needed
+    //!
+    //! If this is on, loadState() only loads the room index from the top-level
+    //! state cache file, with just enough of each room's state to show it in
+    //! the room list; the rest of the room state is loaded from its cache file
+    //! once something needs it (e.g., Room::currentState() or Room::members()
+    //! are called, or a sync brings new events to the room).
+    //! \sa loadState
+    bool lazyCacheLoading() const;
+    void setLazyCacheLoading(bool newValue);
+
+    //! \brief Whether rooms should keep their events in a compact form
+    //!
+    //! If this is on, rooms pack the JSON of timeline and state events
+    //! as they are added (see Event::compactJson()), trading some CPU time
+    //! on adding and first looking into events for a smaller memory footprint.
+    //! This only applies to events added after the change. When this is off,
+    //! events only keep their JSON and accessors such as RoomEvent::id() look
+    //! into it.
+    bool compactEventStorage() const;
+    void setCompactEventStorage(bool newValue);
+
+    //! \brief The maximum number of Olm sessions kept in memory
+    //!
+    //! Olm sessions beyond this number stay in the database and are loaded
+    //! from there when a message from or to their device shows up. Sessions
+    //! of the least recently used devices are unloaded first. -1 (the default)
+    //! means no limit. The limit is applied after processing to-device events
+    //! and sending room keys; a changed value is applied to the already
+    //! loaded sessions at the next such occasion.
+    int maxResidentOlmSessions() const;
+    void setMaxResidentOlmSessions(int newValue);
+
+    //! \brief The maximum number of Olm sessions kept in memory per device
+    //!
+    //! Only the most recently used sessions of each device are kept in
+    //! memory, the rest are loaded from the database if a message cannot be
+    //! decrypted with the loaded ones. -1 (the default) means no limit.
+    //! \sa maxResidentOlmSessions
+    int maxOlmSessionsPerSender() const;
+    void setMaxOlmSessionsPerSender(int newValue);
+
+    //! \brief The number of most recent timeline events each room keeps in memory
+    //!
+    //! Older events get unloaded from room timelines after a sync brings new
+    //! ones, and can be loaded again with Room::getPreviousContent(). Events
+    //! at or after the fully read marker, the local read receipt and the first
+    //! displayed event are never unloaded, so some rooms may keep more events.
+    //! -1 (the default) means no limit.
+    //! \sa Room::unloadedMessages
+    int maxResidentRoomEvents() const;
+    void setMaxResidentRoomEvents(int newValue);
+
+    //! \brief The pool of strings shared by rooms of this connection
+    //!
+    //! Rooms use this pool to share the storage of user ids, event types
+    //! and state keys that repeat across members, read receipts and
+    //! compacted events (see compactEventStorage()).
+    StringPool& stringPool();
+
+    //! \brief The push rules of the account, compiled for evaluation
+    //!
+    //! The rules come from the `m.push_rules` account data; they are compiled
+    //! on the first call and compiled again after the account data changes.
+    //! \sa Room::checkForNotifications
+    const PushRuleEvaluator& pushRuleEvaluator() const;
+
     //! Start a pre-created job object on this connection
     Q_INVOKABLE BaseJob* run(BaseJob* job,
                              RunningPolicy runningPolicy = ForegroundRequest);
@@ -901,6 +979,11 @@ Q_SIGNALS:
 
     void cacheStateChanged();
     void lazyLoadingChanged();
+    void lazyCacheLoadingChanged();
+    void compactEventStorageChanged();
+    void maxResidentOlmSessionsChanged();
+    void maxOlmSessionsPerSenderChanged();
+    void maxResidentRoomEventsChanged();
     void turnServersChanged(const QJsonObject& servers);
     void devicesListLoaded();
 
@@ -8,6 +8,7 @@
 #include "connection.h"
 #include "connectiondata.h"
 #include "connectionencryptiondata_p.h"
+#include "pushruleevaluator.h"
 #include "settings.h"
 #include "syncdata.h"
 
@@ -18,6 +19,7 @@
 #include "csapi/wellknown.h"
 
 #include <QtCore/QCoreApplication>
+#include <QtCore/QThreadPool>
 
 namespace Quotient {
 
@@ -25,7 +27,9 @@ class Q_DECL_HIDDEN Quotient::Connection::Private {
 public:
     explicit Private(std::unique_ptr<ConnectionData>&& connection)
         : data(std::move(connection))
-    {}
+    {
+        cacheWriter.setMaxThreadCount(1);
+    }
 
     Connection* q = nullptr;
     std::unique_ptr<ConnectionData> data;
@@ -75,6 +79,21 @@ public:
                                             SettingsGroup("libQMatrixClient"_ls).get<QString>("cache_type"_ls))
         != "json"_ls;
     bool lazyLoading = false;
+    bool lazyCacheLoading = false;
+    bool compactEventStorage = false;
+    int maxResidentOlmSessions = -1;
+    int maxOlmSessionsPerSender = -1;
+    int maxResidentRoomEvents = -1;
+    StringPool stringPool;
+    //! The compiled push rules; empty until needed or after they change
+    std::optional<PushRuleEvaluator> pushRuleEvaluator;
+    //! \brief Writes room cache files in the background
+    //!
+    //! There's only one thread in this pool, so that writes to the same room's
+    //! cache files happen in the order of saveRoomState() calls.
+    QThreadPool cacheWriter;
+    //! Sizes of room cache journals, for rooms saved (or being saved) to the cache
+    QHash<QString, qint64> roomCacheJournalSizes;
 
     //! \brief Check the homeserver and resolve it if needed, before connecting
     //!
@@ -1,6 +1,7 @@
 #include "connectionencryptiondata_p.h"
 
 #include "logging_categories_p.h"
+#include "parallelfor_p.h"
 #include "qt_connection_util.h"
 #include "room.h"
 #include "syncdata.h"
@@ -15,9 +16,80 @@
 
 #include <QtCore/QCoreApplication>
 
+#include <algorithm>
+#include <limits>
+
 using namespace Quotient;
 using namespace Quotient::_impl;
 
+namespace {
+// Below this number of devices it's not worth encrypting in parallel
+constexpr size_t MinDevicesForParallelEncryption = 16;
+
+// Same for decrypting to-device events
+constexpr size_t MinEventsForParallelDecryption = 16;
+
+// The approximate limit on the size of a single to-device request, in characters
+constexpr qsizetype MaxToDeviceRequestSize = 256 * 1024;
+
+std::pair<QByteArray, QByteArray> doDecryptMessage(const QOlmSession& session,
+                                                   const QOlmMessage& message,
+                                                   auto&& andThen)
+{
+    const auto expectedMessage = session.decrypt(message);
+    if (expectedMessage) {
+        const auto result =
+            std::make_pair(*expectedMessage, session.sessionId());
+        andThen();
+        return result;
+    }
+    const auto errorLine = message.type() == QOlmMessage::PreKey
+                               ? "Failed to decrypt prekey message:"
+                               : "Failed to decrypt message:";
+    qCDebug(E2EE) << errorLine << expectedMessage.error();
+    return {};
+}
+
+//! \brief Try to decrypt an Olm message with the sessions from its sender key
+//!
+//! On success, the session that decrypted the message is moved to the front
+//! of \p sessions. Nothing but \p sessions is touched, so this can be called
+//! for different sender keys in parallel.
+//! \return the plaintext and the session id, or an empty pair if decryption
+//!         failed; std::nullopt if no session starting from \p from could be
+//!         used for the message
+std::optional<std::pair<QByteArray, QByteArray>> decryptWithSessions(
+    std::vector<QOlmSession>& sessions, size_t from, const QByteArray& senderKey,
+    const QOlmMessage& message)
+{
+    // Olm messages don't carry the session id, so sessions have to be tried
+    // one by one; they are kept in the most recently used first order, which
+    // makes the first attempt succeed most of the time
+    for (auto it = sessions.begin() + ptrdiff_t(from); it != sessions.end(); ++it) {
+        if (message.type() == QOlmMessage::PreKey
+            && !it->matchesInboundSessionFrom(senderKey, message))
+            continue;
+        auto result = doDecryptMessage(*it, message, [&sessions, it] {
+            std::rotate(sessions.begin(), it, std::next(it));
+        });
+        // A pre-key message matching the session can't be for any other
+        if (!result.first.isEmpty() || message.type() == QOlmMessage::PreKey)
+            return result;
+    }
+    return std::nullopt;
+}
+
+std::optional<QOlmMessage> toOlmMessage(const QJsonObject& personalCipherObject)
+{
+    const auto msgType = static_cast<QOlmMessage::Type>(
+        personalCipherObject.value(TypeKey).toInt(-1));
+    if (msgType != QOlmMessage::General && msgType != QOlmMessage::PreKey)
+        return std::nullopt;
+    return QOlmMessage{ personalCipherObject.value(BodyKey).toString().toLatin1(), msgType };
+}
+
+} // namespace
+
 Expected<PicklingKey, QKeychain::Error> setupPicklingKey(const QString& id,
                                                          bool mock)
 {
@@ -103,6 +175,7 @@ ConnectionEncryptionData::setup(Connection* connection, bool mock)
                          [connection, eData = encryptionData.get()] {
                              eData->trackedUsers += connection->userId();
                              eData->outdatedUsers += connection->userId();
+                             eData->dirtyUsers += connection->userId();
                              eData->encryptionUpdateRequired = true;
                          });
         QObject::connect(job, &BaseJob::failure, connection, [job] {
@@ -116,68 +189,113 @@ ConnectionEncryptionData::setup(Connection* connection, bool mock)
     return {};
 }
 
-void ConnectionEncryptionData::saveDevicesList()
-{
-    database.transaction();
-    auto query =
-        database.prepareQuery(QStringLiteral("DELETE FROM tracked_users"));
-    database.execute(query);
-    query.prepare(QStringLiteral(
-        "INSERT INTO tracked_users(matrixId) VALUES(:matrixId);"));
-    for (const auto& user : trackedUsers) {
-        query.bindValue(":matrixId"_ls, user);
-        database.execute(query);
-    }
+namespace {
+struct TrackedUserRecord {
+    QString userId;
+    bool tracked;
+    bool outdated;
+};
 
-    query.prepare(QStringLiteral("DELETE FROM outdated_users"));
-    database.execute(query);
-    query.prepare(QStringLiteral(
-        "INSERT INTO outdated_users(matrixId) VALUES(:matrixId);"));
-    for (const auto& user : outdatedUsers) {
-        query.bindValue(":matrixId"_ls, user);
-        database.execute(query);
+struct TrackedDeviceRecord {
+    QString userId;
+    QString deviceId;
+    std::optional<DeviceKeys> keys; //!< std::nullopt if the device is gone
+    bool verified;
+    bool selfVerified;
+};
+
+void saveDevicesChanges(QSqlDatabase& db, const QVector<TrackedUserRecord>& users,
+                        const QVector<TrackedDeviceRecord>& devices)
+{
+    const auto prepare = [&db](const QString& queryString) {
+        QSqlQuery query(db);
+        query.prepare(queryString);
+        return query;
+    };
+    auto trackQuery =
+        prepare(QStringLiteral("INSERT OR IGNORE INTO tracked_users(matrixId) VALUES(:matrixId);"));
+    auto untrackQuery =
+        prepare(QStringLiteral("DELETE FROM tracked_users WHERE matrixId=:matrixId;"));
+    auto markOutdatedQuery =
+        prepare(QStringLiteral("INSERT OR IGNORE INTO outdated_users(matrixId) VALUES(:matrixId);"));
+    auto unmarkOutdatedQuery =
+        prepare(QStringLiteral("DELETE FROM outdated_users WHERE matrixId=:matrixId;"));
+    for (const auto& [userId, tracked, outdated] : users) {
+        auto& trackingQuery = tracked ? trackQuery : untrackQuery;
+        trackingQuery.bindValue(":matrixId"_ls, userId);
+        Database::executeQuery(trackingQuery);
+        auto& outdatedQuery = outdated ? markOutdatedQuery : unmarkOutdatedQuery;
+        outdatedQuery.bindValue(":matrixId"_ls, userId);
+        Database::executeQuery(outdatedQuery);
     }
 
-    query.prepare(QStringLiteral(
+    // The verified flag is only set for new devices; once a device is in
+    // the table, it's updated by Database::setSessionVerified()
+    auto upsertQuery = prepare(QStringLiteral(
         "INSERT INTO tracked_devices"
         "(matrixId, deviceId, curveKeyId, curveKey, edKeyId, edKey, verified, selfVerified) "
-        "VALUES (:matrixId, :deviceId, :curveKeyId, :curveKey, :edKeyId, :edKey, :verified, :selfVerified);"));
-    for (const auto& [user, devices] : deviceKeys.asKeyValueRange()) {
-        auto deleteQuery = database.prepareQuery(
-            QStringLiteral("DELETE FROM tracked_devices WHERE matrixId=:matrixId;"));
-        deleteQuery.bindValue(":matrixId"_ls, user);
-        database.execute(deleteQuery);
-        for (const auto& device : devices) {
-            const auto keys = device.keys.asKeyValueRange();
-            deleteQuery.prepare(
-                "DELETE FROM tracked_devices WHERE matrixId=:matrixId AND deviceId=:deviceId;"_ls);
-            deleteQuery.bindValue(":matrixId"_ls, user);
-            deleteQuery.bindValue(":deviceId"_ls, device.deviceId);
-            database.execute(deleteQuery);
-
-            const auto curveKeyIt = std::ranges::find_if(keys, [](const auto& p) {
-                return p.first.startsWith("curve"_ls);
-            });
-            Q_ASSERT(curveKeyIt != keys.end());
-            const auto edKeyIt = std::ranges::find_if(keys, [](const auto& p) {
-                return p.first.startsWith("ed"_ls);
-            });
-            Q_ASSERT(edKeyIt != keys.end());
-
-            query.bindValue(":matrixId"_ls, user);
-            query.bindValue(":deviceId"_ls, device.deviceId);
-            query.bindValue(":curveKeyId"_ls, curveKeyIt->first);
-            query.bindValue(":curveKey"_ls, curveKeyIt->second);
-            query.bindValue(":edKeyId"_ls, edKeyIt->first);
-            query.bindValue(":edKey"_ls, edKeyIt->second);
-            // If the device gets saved here, it can't be verified
-            query.bindValue(":verified"_ls, verifiedDevices[user][device.deviceId]);
-            query.bindValue(":selfVerified"_ls, selfVerifiedDevices[user][device.deviceId]);
+        "VALUES (:matrixId, :deviceId, :curveKeyId, :curveKey, :edKeyId, :edKey, :verified, :selfVerified) "
+        "ON CONFLICT(matrixId, deviceId) DO UPDATE SET curveKeyId=excluded.curveKeyId, "
+        "curveKey=excluded.curveKey, edKeyId=excluded.edKeyId, edKey=excluded.edKey, "
+        "selfVerified=excluded.selfVerified;"));
+    auto deleteQuery = prepare(
+        "DELETE FROM tracked_devices WHERE matrixId=:matrixId AND deviceId=:deviceId;"_ls);
+    for (const auto& [userId, deviceId, device, verified, selfVerified] : devices) {
+        if (!device) {
+            deleteQuery.bindValue(":matrixId"_ls, userId);
+            deleteQuery.bindValue(":deviceId"_ls, deviceId);
+            Database::executeQuery(deleteQuery);
+            continue;
+        }
+        const auto keys = device->keys.asKeyValueRange();
+        const auto curveKeyIt = std::ranges::find_if(keys, [](const auto& p) {
+            return p.first.startsWith("curve"_ls);
+        });
+        Q_ASSERT(curveKeyIt != keys.end());
+        const auto edKeyIt = std::ranges::find_if(keys, [](const auto& p) {
+            return p.first.startsWith("ed"_ls);
+        });
+        Q_ASSERT(edKeyIt != keys.end());
+
+        upsertQuery.bindValue(":matrixId"_ls, userId);
+        upsertQuery.bindValue(":deviceId"_ls, deviceId);
+        upsertQuery.bindValue(":curveKeyId"_ls, curveKeyIt->first);
+        upsertQuery.bindValue(":curveKey"_ls, curveKeyIt->second);
+        upsertQuery.bindValue(":edKeyId"_ls, edKeyIt->first);
+        upsertQuery.bindValue(":edKey"_ls, edKeyIt->second);
+        // If the device gets saved here, it can't be verified
+        upsertQuery.bindValue(":verified"_ls, verified);
+        upsertQuery.bindValue(":selfVerified"_ls, selfVerified);
+        Database::executeQuery(upsertQuery);
+    }
+}
+} // namespace
 
-            database.execute(query);
+void ConnectionEncryptionData::saveDevicesList()
+{
+    if (dirtyUsers.isEmpty() && dirtyDevices.isEmpty())
+        return;
+
+    QVector<TrackedUserRecord> users;
+    users.reserve(dirtyUsers.size());
+    for (const auto& userId : std::as_const(dirtyUsers))
+        users.push_back(
+            { userId, trackedUsers.contains(userId), outdatedUsers.contains(userId) });
+    QVector<TrackedDeviceRecord> devices;
+    for (const auto& [userId, deviceIds] : dirtyDevices.asKeyValueRange()) {
+        const auto userDevices = deviceKeys.value(userId);
+        for (const auto& deviceId : deviceIds) {
+            const auto it = userDevices.constFind(deviceId);
+            devices.push_back({ userId, deviceId,
+                                it != userDevices.cend() ? std::optional(*it) : std::nullopt,
+                                verifiedDevices.value(userId).value(deviceId),
+                                selfVerifiedDevices.value(userId).value(deviceId) });
         }
     }
-    database.commit();
+    dirtyUsers.clear();
+    dirtyDevices.clear();
+    database.enqueueWrite([users = std::move(users), devices = std::move(devices)](
+                              QSqlDatabase& db) { saveDevicesChanges(db, users, devices); });
 }
 
 void ConnectionEncryptionData::loadDevicesList()
@@ -242,7 +360,8 @@ bool ConnectionEncryptionData::hasOlmSession(const QString& user,
 {
     const auto& curveKey = curveKeyForUserDevice(user, deviceId).toLatin1();
     const auto sessionIt = olmSessions.find(curveKey);
-    return sessionIt != olmSessions.cend() && !sessionIt->second.empty();
+    return (sessionIt != olmSessions.cend() && !sessionIt->second.empty())
+           || storedOlmSessionCounts.value(curveKey) > 0;
 }
 
 void ConnectionEncryptionData::onSyncSuccess(SyncData& syncResponse)
@@ -285,12 +404,14 @@ void ConnectionEncryptionData::consumeDevicesList(const DevicesList& devicesList
     for(const auto &changed : devicesList.changed) {
         if(trackedUsers.contains(changed)) {
             outdatedUsers += changed;
+            dirtyUsers += changed;
             hasNewOutdatedUser = true;
         }
     }
     for(const auto &left : devicesList.left) {
         trackedUsers -= left;
         outdatedUsers -= left;
+        dirtyUsers += left;
         deviceKeys.remove(left);
     }
     if(hasNewOutdatedUser)
@@ -312,25 +433,33 @@ void ConnectionEncryptionData::loadOutdatedUserDevices()
     });
 }
 
-void ConnectionEncryptionData::consumeToDeviceEvent(EventPtr toDeviceEvent)
+void ConnectionEncryptionData::consumeToDeviceEvents(Events&& toDeviceEvents)
 {
-    if (processIfVerificationEvent(*toDeviceEvent, false))
-        return;
-    if (auto&& event = eventCast<EncryptedEvent>(std::move(toDeviceEvent))) {
-        if (event->algorithm() != OlmV1Curve25519AesSha2AlgoKey) {
-            qCDebug(E2EE) << "Unsupported algorithm" << event->id()
-                          << "for event" << event->algorithm();
-            return;
-        }
-        if (isKnownCurveKey(event->senderId(), event->senderKey())) {
-            handleEncryptedToDeviceEvent(*event);
-            return;
-        }
-        trackedUsers += event->senderId();
-        outdatedUsers += event->senderId();
+    // Everything except events from unknown devices is handled in the order of arrival,
+    // since verification flows may interleave plaintext and encrypted events
+    std::vector<const Event*> events;
+    for (auto&& toDeviceEvent : toDeviceEvents) {
+        const auto* encryptedEvent = eventCast<const EncryptedEvent>(toDeviceEvent);
+        if (!encryptedEvent) {
+            events.push_back(toDeviceEvent.get());
+            continue;
+        }
+        if (encryptedEvent->algorithm() != OlmV1Curve25519AesSha2AlgoKey) {
+            qCDebug(E2EE) << "Unsupported algorithm" << encryptedEvent->id()
+                          << "for event" << encryptedEvent->algorithm();
+            continue;
+        }
+        if (isKnownCurveKey(encryptedEvent->senderId(), encryptedEvent->senderKey())) {
+            events.push_back(encryptedEvent);
+            continue;
+        }
+        trackedUsers += encryptedEvent->senderId();
+        outdatedUsers += encryptedEvent->senderId();
+        dirtyUsers += encryptedEvent->senderId();
         encryptionUpdateRequired = true;
-        pendingEncryptedEvents.push_back(std::move(event));
+        pendingEncryptedEvents.push_back(eventCast<EncryptedEvent>(std::move(toDeviceEvent)));
     }
+    handleToDeviceEvents(events);
 }
 
 bool ConnectionEncryptionData::processIfVerificationEvent(const Event& evt,
@@ -367,34 +496,112 @@ public:
     QUO_CONTENT_GETTER(QString, secret)
 };
 
-void ConnectionEncryptionData::handleEncryptedToDeviceEvent(const EncryptedEvent& event)
+void ConnectionEncryptionData::handleToDeviceEvents(const std::vector<const Event*>& events)
 {
-    const auto [decryptedEvent, olmSessionId] = sessionDecryptMessage(event);
-    if (!decryptedEvent) {
-        qCWarning(E2EE) << "Failed to decrypt to-device event from device"
-                        << event.deviceId();
+    if (events.empty())
         return;
+    std::vector<const EncryptedEvent*> encryptedEvents(events.size());
+    std::ranges::transform(events, encryptedEvents.begin(),
+                           [](const Event* e) { return eventCast<const EncryptedEvent>(e); });
+
+    // Olm sessions are per sender key, so events from different sender keys
+    // can be decrypted in parallel, each group with its own sessions.
+    // The parallel stage only uses the sessions already in memory, and stops
+    // for the group at the first event that needs more than that (loading
+    // sessions from the database, creating a new session, or recovering from
+    // a failure); that event and the rest of the group are then decrypted
+    // in order on this thread, below.
+    struct SenderKeyGroup {
+        QByteArray senderKey;
+        std::vector<QOlmSession>* sessions;
+        std::vector<size_t> eventIndices{};
+    };
+    std::vector<SenderKeyGroup> groups;
+    QHash<QByteArray, size_t> groupIndices;
+    for (size_t i = 0; i < events.size(); ++i) {
+        if (!encryptedEvents[i])
+            continue;
+        const auto senderKey = encryptedEvents[i]->senderKey().toLatin1();
+        auto groupIt = groupIndices.constFind(senderKey);
+        if (groupIt == groupIndices.cend()) {
+            groupIt = groupIndices.insert(senderKey, groups.size());
+            // References to values of std::unordered_map survive rehashing
+            groups.push_back({ senderKey, &olmSessions[senderKey] });
+        }
+        groups[*groupIt].eventIndices.push_back(i);
     }
 
-    if (processIfVerificationEvent(*decryptedEvent, true))
-        return;
-    decryptedEvent->switchOnType(
-        [this, &event, olmSessionId](const RoomKeyEvent& roomKeyEvent) {
-            if (auto* detectedRoom = q->room(roomKeyEvent.roomId())) {
-                detectedRoom->handleRoomKeyEvent(roomKeyEvent, event.senderId(),
-                                                 olmSessionId, event.senderKey().toLatin1(), q->edKeyForUserDevice(event.senderId(), event.deviceId()).toLatin1());
+    std::vector<std::optional<std::pair<QByteArray, QByteArray>>> decryptedMessages(
+        events.size());
+    const auto identityKey = olmAccount.identityKeys().curve25519;
+    const auto decryptGroup = [&groups, &encryptedEvents, &decryptedMessages,
+                               &identityKey](size_t g) {
+        const auto& group = groups[g];
+        for (const auto i : group.eventIndices) {
+            const auto message = toOlmMessage(encryptedEvents[i]->ciphertext(identityKey));
+            if (!message)
+                break;
+            auto result = decryptWithSessions(*group.sessions, 0, group.senderKey, *message);
+            if (!result || result->first.isEmpty())
+                break;
+            decryptedMessages[i] = std::move(result);
+        }
+    };
+    if (groups.size() > 1 && events.size() >= MinEventsForParallelDecryption)
+        _impl::parallelFor(groups.size(), decryptGroup);
+    else
+        for (size_t g = 0; g < groups.size(); ++g)
+            decryptGroup(g);
+
+    // Room keys are applied in one batch per room after all events are
+    // handled, so that each room retries decryption of its events only once
+    std::unordered_map<Room*, std::vector<ReceivedRoomKey>> roomKeys;
+    for (size_t i = 0; i < events.size(); ++i) {
+        if (!encryptedEvents[i]) {
+            processIfVerificationEvent(*events[i], false);
+            continue;
+        }
+        const auto& event = *encryptedEvents[i];
+        std::pair<EventPtr, QByteArray> decryptionResult;
+        if (const auto& decryptedMessage = decryptedMessages[i]) {
+            markOlmSessionUsed(event.senderKey().toLatin1(), decryptedMessage->second);
+            decryptionResult =
+                finishOlmDecryption(event, decryptedMessage->first, decryptedMessage->second);
+        } else
+            decryptionResult = sessionDecryptMessage(event);
+        auto& [decryptedEvent, olmSessionId] = decryptionResult;
+        if (!decryptedEvent) {
+            qCWarning(E2EE) << "Failed to decrypt to-device event from device"
+                            << event.deviceId();
+            continue;
+        }
+
+        if (processIfVerificationEvent(*decryptedEvent, true))
+            continue;
+        if (auto&& roomKeyEvent = eventCast<RoomKeyEvent>(std::move(decryptedEvent))) {
+            if (auto* detectedRoom = q->room(roomKeyEvent->roomId())) {
+                auto senderEdKey =
+                    q->edKeyForUserDevice(event.senderId(), event.deviceId()).toLatin1();
+                roomKeys[detectedRoom].push_back({ std::move(roomKeyEvent), event.senderId(),
+                                                   olmSessionId, event.senderKey().toLatin1(),
+                                                   std::move(senderEdKey) });
             } else {
                 qCDebug(E2EE)
-                    << "Encrypted event room id" << roomKeyEvent.roomId()
+                    << "Encrypted event room id" << roomKeyEvent->roomId()
                     << "is not found at the connection" << q->objectName();
             }
-        },
-        [this](const SecretSendEvent& sse) {
-            emit q->secretReceived(sse.requestId(), sse.secret());
-        },
-        [](const Event& evt) {
-            qCWarning(E2EE) << "Skipping encrypted to_device event, type" << evt.matrixType();
-        });
+            continue;
+        }
+        decryptedEvent->switchOnType(
+            [this](const SecretSendEvent& sse) {
+                emit q->secretReceived(sse.requestId(), sse.secret());
+            },
+            [](const Event& evt) {
+                qCWarning(E2EE) << "Skipping encrypted to_device event, type" << evt.matrixType();
+            });
+    }
+    for (const auto& [room, keys] : roomKeys)
+        room->handleRoomKeyEvents(keys);
 }
 
 void ConnectionEncryptionData::handleMasterKeys(const QHash<QString, CrossSigningKey>& masterKeys)
@@ -567,6 +774,7 @@ void ConnectionEncryptionData::handleDevicesList(
 {
     for(const auto &[user, keys] : newDeviceKeys.asKeyValueRange()) {
         const auto oldDevices = deviceKeys[user];
+        const auto oldSelfVerified = selfVerifiedDevices.value(user);
         auto query = database.prepareQuery("SELECT * FROM self_signing_keys WHERE userId=:userId;"_ls);
         query.bindValue(":userId"_ls, user);
         database.execute(query);
@@ -614,7 +822,19 @@ void ConnectionEncryptionData::handleDevicesList(
             }
             deviceKeys[user][device.deviceId] = SLICE(device, DeviceKeys);
         }
+        auto& changedDevices = dirtyDevices[user];
+        for (const auto& [deviceId, newDevice] : deviceKeys[user].asKeyValueRange())
+            if (const auto oldIt = oldDevices.constFind(deviceId);
+                oldIt == oldDevices.cend() || oldIt->keys != newDevice.keys
+                || oldSelfVerified.value(deviceId) != selfVerifiedDevices[user].value(deviceId))
+                changedDevices += deviceId;
+        for (const auto& deviceId : oldDevices.keys())
+            if (!deviceKeys[user].contains(deviceId))
+                changedDevices += deviceId;
+        if (changedDevices.isEmpty())
+            dirtyDevices.remove(user);
         outdatedUsers -= user;
+        dirtyUsers += user;
     }
 }
 
@@ -630,19 +850,17 @@ void ConnectionEncryptionData::handleQueryKeys(const QueryKeysJob::Response& key
 
     saveDevicesList();
 
-    // A completely faithful code would call std::partition() with bare
-    // isKnownCurveKey(), then handleEncryptedToDeviceEvent() on each event
-    // with the known key, and then std::erase()... but
-    // handleEncryptedToDeviceEvent() doesn't have side effects on the handled
-    // events so a small corner-cutting should be fine.
-    std::erase_if(pendingEncryptedEvents,
-                  [this](const event_ptr_tt<EncryptedEvent>& pendingEvent) {
-                      if (!isKnownCurveKey(pendingEvent->senderId(),
-                                           pendingEvent->senderKey()))
-                          return false;
-                      handleEncryptedToDeviceEvent(*pendingEvent);
-                      return true;
-                  });
+    const auto knownSenderEventsIt =
+        std::stable_partition(pendingEncryptedEvents.begin(), pendingEncryptedEvents.end(),
+                              [this](const event_ptr_tt<EncryptedEvent>& pendingEvent) {
+                                  return !isKnownCurveKey(pendingEvent->senderId(),
+                                                          pendingEvent->senderKey());
+                              });
+    std::vector<const Event*> knownSenderEvents;
+    for (auto it = knownSenderEventsIt; it != pendingEncryptedEvents.end(); ++it)
+        knownSenderEvents.push_back(it->get());
+    handleToDeviceEvents(knownSenderEvents);
+    pendingEncryptedEvents.erase(knownSenderEventsIt, pendingEncryptedEvents.end());
 }
 
 void ConnectionEncryptionData::encryptionUpdate(const QList<QString>& forUsers)
@@ -651,6 +869,7 @@ void ConnectionEncryptionData::encryptionUpdate(const QList<QString>& forUsers)
         if (!trackedUsers.contains(userId)) {
             trackedUsers += userId;
             outdatedUsers += userId;
+            dirtyUsers += userId;
             encryptionUpdateRequired = true;
         }
 }
@@ -696,85 +915,105 @@ bool ConnectionEncryptionData::createOlmSession(
         return false;
     }
     saveSession(*session, recipientCurveKey);
-    olmSessions[recipientCurveKey].push_back(std::move(*session));
+    addOlmSession(recipientCurveKey, std::move(*session));
     return true;
 }
 
-std::pair<QOlmMessage::Type, QByteArray>
-ConnectionEncryptionData::olmEncryptMessage(const QString& userId,
-                                            const QString& device,
-                                            const QByteArray& message) const
-{
-    const auto& curveKey = curveKeyForUserDevice(userId, device).toLatin1();
-    const auto& olmSession = olmSessions.at(curveKey).front();
-    const auto result = olmSession.encrypt(message);
-    database.updateOlmSession(curveKey, olmSession);
-    return { result.type(), result.toCiphertext() };
-}
-
-QJsonObject ConnectionEncryptionData::assembleEncryptedContent(
-    QJsonObject payloadJson, const QString& targetUserId,
-    const QString& targetDeviceId) const
+QJsonObject ConnectionEncryptionData::senderPayload(QJsonObject payloadJson) const
 {
     payloadJson.insert(SenderKey, q->userId());
     payloadJson.insert("keys"_ls,
                        QJsonObject{
                            { Ed25519Key, olmAccount.identityKeys().ed25519 } });
+    return payloadJson;
+}
+
+QJsonObject ConnectionEncryptionData::olmEncryptedContent(
+    QJsonObject payloadJson, const QString& targetUserId, const QString& targetEdKey,
+    const QString& targetCurveKey, const QOlmSession& olmSession,
+    const QString& senderCurveKey)
+{
     payloadJson.insert("recipient"_ls, targetUserId);
-    payloadJson.insert(
-        "recipient_keys"_ls,
-        QJsonObject{ { Ed25519Key,
-                       q->edKeyForUserDevice(targetUserId, targetDeviceId) } });
-    const auto [type, cipherText] = olmEncryptMessage(
-        targetUserId, targetDeviceId,
-        QJsonDocument(payloadJson).toJson(QJsonDocument::Compact));
+    payloadJson.insert("recipient_keys"_ls, QJsonObject{ { Ed25519Key, targetEdKey } });
+    const auto message =
+        olmSession.encrypt(QJsonDocument(payloadJson).toJson(QJsonDocument::Compact));
     QJsonObject encrypted{
-        { curveKeyForUserDevice(targetUserId, targetDeviceId),
-          QJsonObject{ { "type"_ls, type },
-                       { "body"_ls, QString::fromLatin1(cipherText) } } }
+        { targetCurveKey,
+          QJsonObject{ { "type"_ls, message.type() },
+                       { "body"_ls, QString::fromLatin1(message.toCiphertext()) } } }
     };
-    return EncryptedEvent(encrypted, olmAccount.identityKeys().curve25519)
-        .contentJson();
+    return EncryptedEvent(encrypted, senderCurveKey).contentJson();
 }
 
-std::pair<QByteArray, QByteArray> doDecryptMessage(const QOlmSession& session,
-                                                   const QOlmMessage& message,
-                                                   auto&& andThen)
+QJsonObject ConnectionEncryptionData::assembleEncryptedContent(
+    QJsonObject payloadJson, const QString& targetUserId,
+    const QString& targetDeviceId)
 {
-    const auto expectedMessage = session.decrypt(message);
-    if (expectedMessage) {
-        const auto result =
-            std::make_pair(*expectedMessage, session.sessionId());
-        andThen();
-        return result;
+    const auto curveKey = curveKeyForUserDevice(targetUserId, targetDeviceId);
+    const auto* olmSession = mruOlmSession(curveKey.toLatin1());
+    Q_ASSERT(olmSession != nullptr);
+    auto content = olmEncryptedContent(senderPayload(std::move(payloadJson)), targetUserId,
+                                       q->edKeyForUserDevice(targetUserId, targetDeviceId),
+                                       curveKey, *olmSession,
+                                       olmAccount.identityKeys().curve25519);
+    database.updateOlmSession(curveKey.toLatin1(), *olmSession);
+    return content;
+}
+
+void ConnectionEncryptionData::sendToDevicesInChunks(
+    const QString& eventType, const QHash<QString, QHash<QString, QJsonObject>>& contents)
+{
+    // Large requests are split by the approximate size of the payload, and
+    // all of them are sent right away rather than one after another
+    QHash<QString, QHash<QString, QJsonObject>> chunk;
+    qsizetype chunkSize = 0;
+    int chunksSent = 0;
+    for (const auto& [userId, devicesToContent] : contents.asKeyValueRange())
+        for (const auto& [deviceId, content] : devicesToContent.asKeyValueRange()) {
+            qsizetype contentSize = userId.size() + deviceId.size();
+            for (const auto& ciphertext : content.value(CiphertextKey).toObject())
+                contentSize += ciphertext.toObject().value("body"_ls).toString().size();
+            if (chunkSize > 0 && chunkSize + contentSize > MaxToDeviceRequestSize) {
+                q->sendToDevices(eventType, chunk);
+                ++chunksSent;
+                chunk.clear();
+                chunkSize = 0;
+            }
+            chunk[userId].insert(deviceId, content);
+            chunkSize += contentSize;
+        }
+    if (!chunk.isEmpty()) {
+        q->sendToDevices(eventType, chunk);
+        ++chunksSent;
     }
-    const auto errorLine = message.type() == QOlmMessage::PreKey
-                               ? "Failed to decrypt prekey message:"
-                               : "Failed to decrypt message:";
-    qCDebug(E2EE) << errorLine << expectedMessage.error();
-    return {};
+    if (chunksSent > 1)
+        qCDebug(E2EE) << "Sent" << eventType << "to-device messages in" << chunksSent
+                      << "requests";
 }
 
 std::pair<QByteArray, QByteArray> ConnectionEncryptionData::sessionDecryptMessage(
     const QJsonObject& personalCipherObject, const QByteArray& senderKey)
 {
-    const auto msgType = static_cast<QOlmMessage::Type>(
-        personalCipherObject.value(TypeKey).toInt(-1));
-    if (msgType != QOlmMessage::General && msgType != QOlmMessage::PreKey) {
-        qCWarning(E2EE) << "Olm message has incorrect type" << msgType;
+    const auto maybeMessage = toOlmMessage(personalCipherObject);
+    if (!maybeMessage) {
+        qCWarning(E2EE) << "Olm message has incorrect type"
+                        << personalCipherObject.value(TypeKey).toInt(-1);
         return {};
     }
-    const QOlmMessage message{
-        personalCipherObject.value(BodyKey).toString().toLatin1(), msgType
-    };
-    for (const auto& session : olmSessions[senderKey])
-        if (msgType == QOlmMessage::General
-            || session.matchesInboundSessionFrom(senderKey, message)) {
-            return doDecryptMessage(session, message, [this, &session] {
-                q->database()->setOlmSessionLastReceived(
-                    session.sessionId(), QDateTime::currentDateTime());
-            });
-        }
+    const auto& message = *maybeMessage;
+    const auto msgType = message.type();
+    auto& sessions = olmSessions[senderKey];
+    auto result = decryptWithSessions(sessions, 0, senderKey, message);
+    // Only some of the sessions may be in memory; try the rest before giving
+    // up or creating a new session
+    if (!result)
+        if (const auto residentCount = sessions.size(); loadColdOlmSessions(senderKey))
+            result = decryptWithSessions(sessions, residentCount, senderKey, message);
+    if (result) {
+        if (!result->first.isEmpty())
+            markOlmSessionUsed(senderKey, result->second);
+        return *result;
+    }
 
     if (msgType == QOlmMessage::General) {
         qCWarning(E2EE) << "Failed to decrypt message";
@@ -796,7 +1035,7 @@ std::pair<QByteArray, QByteArray> ConnectionEncryptionData::sessionDecryptMessag
     }
     return doDecryptMessage(newSession, message, [this, &senderKey, &newSession] {
         saveSession(newSession, senderKey);
-        olmSessions[senderKey].push_back(std::move(newSession));
+        addOlmSession(senderKey, std::move(newSession));
     });
 }
 
@@ -815,6 +1054,13 @@ std::pair<EventPtr, QByteArray> ConnectionEncryptionData::sessionDecryptMessage(
     const auto [decrypted, olmSessionId] =
         sessionDecryptMessage(personalCipherObject,
                               encryptedEvent.senderKey().toLatin1());
+    return finishOlmDecryption(encryptedEvent, decrypted, olmSessionId);
+}
+
+std::pair<EventPtr, QByteArray> ConnectionEncryptionData::finishOlmDecryption(
+    const EncryptedEvent& encryptedEvent, const QByteArray& decrypted,
+    const QByteArray& olmSessionId)
+{
     if (decrypted.isEmpty()) {
         qDebug(E2EE) << "Problem with new session from senderKey:"
                      << encryptedEvent.senderKey()
@@ -908,35 +1154,70 @@ void ConnectionEncryptionData::doSendSessionKeyToDevices(
 
     const auto sendKey = [devices, this, sessionId, messageIndex, sessionKey,
                           roomId] {
-        QHash<QString, QHash<QString, QJsonObject>> usersToDevicesToContent;
+        // Everything that needs the connection state is collected here;
+        // each device has its own Olm session, so the encryption itself can
+        // be done in parallel
+        struct Target {
+            QString userId;
+            QString deviceId;
+            QString curveKey;
+            QString edKey;
+            const QOlmSession* olmSession;
+            QJsonObject content = {};
+        };
+        std::vector<Target> targets;
+        QSet<QString> targetCurveKeys;
         for (const auto& [targetUserId, targetDeviceId] : devices.asKeyValueRange()) {
             if (!hasOlmSession(targetUserId, targetDeviceId))
                 continue;
+            auto curveKey = curveKeyForUserDevice(targetUserId, targetDeviceId);
+            if (targetCurveKeys.contains(curveKey))
+                continue; // Never use the same Olm session from two threads
+            targetCurveKeys.insert(curveKey);
 
             // Noisy and leaks the key to logs but nice for debugging
 //            qDebug(E2EE) << "Creating the payload for" << targetUserId
 //                         << targetDeviceId << sessionId << sessionKey.toHex();
-            const auto keyEventJson =
-                RoomKeyEvent(MegolmV1AesSha2AlgoKey, roomId,
-                             QString::fromLatin1(sessionId),
-                             QString::fromLatin1(sessionKey))
-                    .fullJson();
-
-            usersToDevicesToContent[targetUserId][targetDeviceId] =
-                assembleEncryptedContent(keyEventJson, targetUserId,
-                                         targetDeviceId);
-        }
-        if (!usersToDevicesToContent.empty()) {
-            q->sendToDevices(EncryptedEvent::TypeId, usersToDevicesToContent);
+            const auto* olmSession = mruOlmSession(curveKey.toLatin1());
+            if (!olmSession)
+                continue;
+            targets.push_back({ targetUserId, targetDeviceId, std::move(curveKey),
+                                q->edKeyForUserDevice(targetUserId, targetDeviceId),
+                                olmSession });
+        }
+        if (!targets.empty()) {
+            const auto payloadJson =
+                senderPayload(RoomKeyEvent(MegolmV1AesSha2AlgoKey, roomId,
+                                           QString::fromLatin1(sessionId),
+                                           QString::fromLatin1(sessionKey))
+                                  .fullJson());
+            const auto senderCurveKey = olmAccount.identityKeys().curve25519;
+            const auto encryptForTarget = [&targets, &payloadJson, &senderCurveKey](size_t i) {
+                auto& t = targets[i];
+                t.content = olmEncryptedContent(payloadJson, t.userId, t.edKey, t.curveKey,
+                                                *t.olmSession, senderCurveKey);
+            };
+            if (targets.size() >= MinDevicesForParallelEncryption)
+                _impl::parallelFor(targets.size(), encryptForTarget);
+            else
+                for (size_t i = 0; i < targets.size(); ++i)
+                    encryptForTarget(i);
+
+            // Only the devices the key is actually sent to are recorded; the others
+            // (e.g., those sharing a curve key with another target) get it next time
+            QHash<QString, QHash<QString, QJsonObject>> usersToDevicesToContent;
             QVector<std::tuple<QString, QString, QString>> receivedDevices;
-            receivedDevices.reserve(devices.size());
-            for (const auto& [user, device] : devices.asKeyValueRange())
-                receivedDevices.push_back(
-                    { user, device, curveKeyForUserDevice(user, device) });
-
+            receivedDevices.reserve(qsizetype(targets.size()));
+            for (auto& t : targets) {
+                database.updateOlmSession(t.curveKey.toLatin1(), *t.olmSession);
+                usersToDevicesToContent[t.userId][t.deviceId] = std::move(t.content);
+                receivedDevices.push_back({ t.userId, t.deviceId, t.curveKey });
+            }
+            sendToDevicesInChunks(EncryptedEvent::TypeId, usersToDevicesToContent);
             database.setDevicesReceivedKey(roomId, receivedDevices,
                                            sessionId, messageIndex);
         }
+        trimOlmSessions();
     };
 
     if (hash.isEmpty()) {
@@ -975,12 +1256,117 @@ ConnectionEncryptionData::ConnectionEncryptionData(Connection* connection,
     : q(connection)
     , olmAccount(q->userId(), q->deviceId())
     , database(q->userId(), q->deviceId(), std::move(picklingKey))
-    , olmSessions(database.loadOlmSessions())
+    , olmSessions(database.loadOlmSessions(q->maxOlmSessionsPerSender(),
+                                           q->maxResidentOlmSessions()))
+    , storedOlmSessionCounts(database.olmSessionCounts())
 {
     QObject::connect(&olmAccount, &QOlmAccount::needsSave, q,
                      [this] { saveOlmAccount(); });
 }
 
+ConnectionEncryptionData::~ConnectionEncryptionData()
+{
+    saveOlmSessionsLastReceived();
+}
+
+void ConnectionEncryptionData::addOlmSession(const QByteArray& senderKey, QOlmSession&& session)
+{
+    auto& sessions = olmSessions[senderKey];
+    sessions.insert(sessions.begin(), std::move(session));
+    olmSessionsLastUse.insert(senderKey, ++olmSessionsUseCounter);
+}
+
+void ConnectionEncryptionData::markOlmSessionUsed(const QByteArray& senderKey,
+                                                  const QByteArray& sessionId)
+{
+    unsavedOlmSessionsLastReceived.insert(sessionId, QDateTime::currentDateTime());
+    olmSessionsLastUse.insert(senderKey, ++olmSessionsUseCounter);
+}
+
+QOlmSession* ConnectionEncryptionData::mruOlmSession(const QByteArray& senderKey)
+{
+    if (const auto it = olmSessions.find(senderKey);
+        (it == olmSessions.end() || it->second.empty()) && !loadColdOlmSessions(senderKey))
+        return nullptr;
+    olmSessionsLastUse.insert(senderKey, ++olmSessionsUseCounter);
+    return &olmSessions.at(senderKey).front();
+}
+
+bool ConnectionEncryptionData::loadColdOlmSessions(const QByteArray& senderKey)
+{
+    auto& sessions = olmSessions[senderKey];
+    if (qsizetype(sessions.size()) >= storedOlmSessionCounts.value(senderKey))
+        return false;
+
+    // The loaded sessions may be ahead of what's in the database; keep them
+    QSet<QByteArray> residentIds;
+    for (const auto& session : sessions)
+        residentIds.insert(session.sessionId());
+    const auto residentCount = sessions.size();
+    for (auto&& session : database.loadOlmSessions(senderKey))
+        if (!residentIds.contains(session.sessionId()))
+            sessions.push_back(std::move(session));
+    qCDebug(E2EE) << "Loaded" << sessions.size() - residentCount << "Olm session(s) with"
+                  << senderKey << "from the database";
+    return sessions.size() > residentCount;
+}
+
+void ConnectionEncryptionData::trimOlmSessions()
+{
+    const auto maxPerSender = q->maxOlmSessionsPerSender() < 0
+                                  ? std::numeric_limits<size_t>::max()
+                                  : size_t(q->maxOlmSessionsPerSender());
+    const auto maxTotal = q->maxResidentOlmSessions() < 0
+                              ? std::numeric_limits<size_t>::max()
+                              : size_t(q->maxResidentOlmSessions());
+
+    // Sessions are not saved after every decryption, so the state of those
+    // to be unloaded has to be saved before they go
+    std::vector<std::pair<QByteArray, const QOlmSession*>> evicted;
+    std::vector<std::pair<quint64, QByteArray>> senderKeysByLastUse;
+    size_t total = 0;
+    for (const auto& [senderKey, sessions] : olmSessions) {
+        for (auto i = maxPerSender; i < sessions.size(); ++i)
+            evicted.emplace_back(senderKey, &sessions[i]);
+        total += std::min(sessions.size(), maxPerSender);
+        senderKeysByLastUse.emplace_back(olmSessionsLastUse.value(senderKey), senderKey);
+    }
+    // When there are still too many, unload all sessions of the least
+    // recently used sender keys; those without sessions go along the way
+    std::ranges::sort(senderKeysByLastUse);
+    std::vector<QByteArray> evictedSenderKeys;
+    for (const auto& [lastUse, senderKey] : senderKeysByLastUse) {
+        const auto& sessions = olmSessions.at(senderKey);
+        if (total <= maxTotal && !sessions.empty())
+            break;
+        const auto keptCount = std::min(sessions.size(), maxPerSender);
+        for (size_t i = 0; i < keptCount; ++i)
+            evicted.emplace_back(senderKey, &sessions[i]);
+        total -= keptCount;
+        evictedSenderKeys.push_back(senderKey);
+    }
+    if (!evicted.empty()) {
+        database.updateOlmSessions(evicted);
+        qCDebug(E2EE) << "Unloaded" << evicted.size() << "Olm session(s) from memory";
+    }
+
+    for (const auto& senderKey : evictedSenderKeys) {
+        olmSessions.erase(senderKey);
+        olmSessionsLastUse.remove(senderKey);
+    }
+    for (auto& [senderKey, sessions] : olmSessions)
+        if (sessions.size() > maxPerSender)
+            sessions.erase(sessions.begin() + ptrdiff_t(maxPerSender), sessions.end());
+}
+
+void ConnectionEncryptionData::saveOlmSessionsLastReceived()
+{
+    if (unsavedOlmSessionsLastReceived.isEmpty())
+        return;
+    database.setOlmSessionsLastReceived(unsavedOlmSessionsLastReceived);
+    unsavedOlmSessionsLastReceived.clear();
+}
+
 void ConnectionEncryptionData::saveOlmAccount()
 {
     qCDebug(E2EE) << "Saving olm account";
@@ -990,6 +1376,7 @@ void ConnectionEncryptionData::saveOlmAccount()
 void ConnectionEncryptionData::reloadDevices()
 {
     outdatedUsers = trackedUsers;
+    dirtyUsers += trackedUsers;
     loadOutdatedUserDevices();
 }
 
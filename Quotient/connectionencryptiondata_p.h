@@ -18,12 +18,24 @@ namespace _impl {
     public:
         static std::optional<std::unique_ptr<ConnectionEncryptionData>> setup(Connection* connection,
                                                                               bool mock = false);
+        ~ConnectionEncryptionData();
 
         Connection* q;
         QOlmAccount olmAccount;
         // No easy way in C++ to discern between SQL SELECT from UPDATE, too bad
         mutable Database database;
+        //! Olm sessions by sender key, the most recently used first
         std::unordered_map<QByteArray, std::vector<QOlmSession>> olmSessions;
+        //! Last received times of Olm sessions not saved to the database yet
+        QHash<QByteArray, QDateTime> unsavedOlmSessionsLastReceived;
+        //! \brief Numbers of Olm sessions in the database, by sender key
+        //!
+        //! Only some of them may be loaded to olmSessions, see
+        //! Connection::maxResidentOlmSessions()
+        QHash<QByteArray, int> storedOlmSessionCounts;
+        //! Recency of use of the loaded Olm sessions, by sender key
+        QHash<QByteArray, quint64> olmSessionsLastUse;
+        quint64 olmSessionsUseCounter = 0;
         //! A map from SenderKey to vector of InboundSession
         QHash<QString, KeyVerificationSession*> verificationSessions{};
         QSet<QString> trackedUsers{};
@@ -41,6 +53,12 @@ namespace _impl {
         QHash<QString, QHash<QString, bool>> selfVerifiedDevices;
         QHash<QString, QHash<QString, bool>> verifiedDevices;
 
+        //! Users whose tracked/outdated status has changed since the last save
+        QSet<QString> dirtyUsers;
+        //! Ids of devices that have changed since the last save, by user id
+        QHash<QString, QSet<QString>> dirtyDevices;
+
+        //! Queue saving the changes in the devices list to the database thread
         void saveDevicesList();
         void loadDevicesList();
         QString curveKeyForUserDevice(const QString& userId,
@@ -51,7 +69,7 @@ namespace _impl {
 
         void onSyncSuccess(SyncData &syncResponse);
         void loadOutdatedUserDevices();
-        void consumeToDeviceEvent(EventPtr toDeviceEvent);
+        void consumeToDeviceEvents(Events&& toDeviceEvents);
         void encryptionUpdate(const QList<QString>& forUsers);
 
         bool createOlmSession(const QString& targetUserId,
@@ -61,18 +79,43 @@ namespace _impl {
         {
             database.saveOlmSession(senderKey, session,
                                     QDateTime::currentDateTime());
+            ++storedOlmSessionCounts[senderKey];
         }
         void saveOlmAccount();
+        void addOlmSession(const QByteArray& senderKey, QOlmSession&& session);
+        //! Queue saving the last received times of Olm sessions used since the last call
+        void saveOlmSessionsLastReceived();
+        //! \brief Get the most recently used Olm session with the sender key
+        //!
+        //! The sessions are loaded from the database if none is in memory.
+        //! \return nullptr if there's no Olm session with the sender key
+        QOlmSession* mruOlmSession(const QByteArray& senderKey);
+        //! Record that the Olm session with the sender key has received a message
+        void markOlmSessionUsed(const QByteArray& senderKey, const QByteArray& sessionId);
+        //! \brief Load the Olm sessions with the sender key that are not in memory
+        //! \return whether any sessions have been loaded
+        bool loadColdOlmSessions(const QByteArray& senderKey);
+        //! \brief Unload Olm sessions beyond the limits set on the connection
+        //!
+        //! The state of unloaded sessions is saved to the database.
+        //! \sa Connection::maxResidentOlmSessions,
+        //!     Connection::maxOlmSessionsPerSender
+        void trimOlmSessions();
         void reloadDevices();
 
         std::pair<QByteArray, QByteArray> sessionDecryptMessage(
             const QJsonObject& personalCipherObject,
             const QByteArray& senderKey);
         std::pair<EventPtr, QByteArray> sessionDecryptMessage(const EncryptedEvent& encryptedEvent);
+        //! Check and parse the Olm plaintext, or try to recover the session if it's empty
+        std::pair<EventPtr, QByteArray> finishOlmDecryption(const EncryptedEvent& encryptedEvent,
+                                                            const QByteArray& decrypted,
+                                                            const QByteArray& olmSessionId);
 
+        // This function assumes that an olm session with (user, device) exists
         QJsonObject assembleEncryptedContent(
             QJsonObject payloadJson, const QString& targetUserId,
-            const QString& targetDeviceId) const;
+            const QString& targetDeviceId);
         void sendSessionKeyToDevices(
             const QString& roomId,
             const QOlmOutboundGroupSession& outboundSession,
@@ -112,12 +155,29 @@ namespace _impl {
     private:
         void consumeDevicesList(const DevicesList &devicesList);
         bool processIfVerificationEvent(const Event& evt, bool encrypted);
-        void handleEncryptedToDeviceEvent(const EncryptedEvent& event);
-
-        // This function assumes that an olm session with (user, device) exists
-        std::pair<QOlmMessage::Type, QByteArray> olmEncryptMessage(
-            const QString& userId, const QString& device,
-            const QByteArray& message) const;
+        //! \brief Handle to-device events, decrypting those from known devices
+        //!
+        //! Encrypted events from different sender keys are decrypted upfront,
+        //! in parallel when there are many of them; then all events are handled
+        //! in the order they come in \p events. Room keys are passed to rooms
+        //! in one batch per room after that.
+        void handleToDeviceEvents(const std::vector<const Event*>& events);
+
+        //! Add the sender's user id and keys to the payload of an Olm message
+        QJsonObject senderPayload(QJsonObject payloadJson) const;
+        //! \brief Encrypt the payload for a single device
+        //!
+        //! This only uses the data passed to it and can be called from any
+        //! thread, as long as \p olmSession is not used elsewhere at the time.
+        static QJsonObject olmEncryptedContent(QJsonObject payloadJson,
+                                               const QString& targetUserId,
+                                               const QString& targetEdKey,
+                                               const QString& targetCurveKey,
+                                               const QOlmSession& olmSession,
+                                               const QString& senderCurveKey);
+        void sendToDevicesInChunks(
+            const QString& eventType,
+            const QHash<QString, QHash<QString, QJsonObject>>& contents);
 
         void doSendSessionKeyToDevices(const QString& roomId, const QByteArray& sessionId,
             const QByteArray &sessionKey, uint32_t messageIndex,
@@ -13,29 +13,140 @@
 #include "e2ee/cryptoutils.h"
 
 #include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QMutex>
 #include <QtCore/QStandardPaths>
+#include <QtCore/QThread>
+#include <QtCore/QWaitCondition>
 #include <QtSql/QSqlDatabase>
 #include <QtSql/QSqlError>
 #include <QtSql/QSqlQuery>
 
+#include <deque>
+
 using namespace Quotient;
 
+class Database::WriterThread : public QThread {
+public:
+    WriterThread(QString connectionName, QString databaseName)
+        : connectionName(std::move(connectionName)), databaseName(std::move(databaseName))
+    {
+        setObjectName("Quotient database writer"_ls);
+    }
+
+    void enqueue(WriteJob&& job)
+    {
+        const QMutexLocker l(&mutex);
+        queue.push_back(std::move(job));
+        ++pendingJobs;
+        queueChanged.wakeOne();
+    }
+
+    void waitForIdle()
+    {
+        if (pendingJobs.loadAcquire() == 0)
+            return;
+        const QMutexLocker l(&mutex);
+        while (pendingJobs.loadRelaxed() > 0)
+            idle.wait(&mutex);
+    }
+
+    //! Finish the queued jobs and quit the thread
+    void stop()
+    {
+        {
+            const QMutexLocker l(&mutex);
+            stopping = true;
+            queueChanged.wakeAll();
+        }
+        wait();
+    }
+
+protected:
+    void run() override
+    {
+        {
+            auto db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), connectionName);
+            db.setDatabaseName(databaseName);
+            const auto opened = db.open();
+            if (opened) // journal_mode is persistent but synchronous is per connection
+                QSqlQuery(QStringLiteral("PRAGMA synchronous=NORMAL;"), db);
+            else
+                qCritical(DATABASE) << "Failed to open the database in the writer thread:"
+                                    << db.lastError();
+            while (true) {
+                std::deque<WriteJob> batch;
+                {
+                    const QMutexLocker l(&mutex);
+                    while (queue.empty() && !stopping)
+                        queueChanged.wait(&mutex);
+                    if (queue.empty())
+                        break;
+                    batch.swap(queue);
+                }
+                if (opened)
+                    runBatch(db, batch);
+                else
+                    qCritical(DATABASE) << "Dropping" << batch.size()
+                                        << "database writes, the database is not open";
+                const QMutexLocker l(&mutex);
+                if ((pendingJobs -= int(batch.size())) == 0)
+                    idle.wakeAll();
+            }
+        }
+        QSqlDatabase::removeDatabase(connectionName);
+    }
+
+private:
+    static void runBatch(QSqlDatabase& db, const std::deque<WriteJob>& batch)
+    {
+        const auto inTransaction = db.transaction();
+        if (!inTransaction)
+            qCritical(DATABASE) << "Failed to start a transaction in the writer thread,"
+                                   " doing the writes one by one:"
+                                << db.lastError();
+        for (const auto& job : batch)
+            job(db);
+        if (inTransaction && !db.commit()) {
+            qCritical(DATABASE) << "Failed to commit" << batch.size()
+                                << "database writes:" << db.lastError();
+            db.rollback();
+        }
+    }
+
+    const QString connectionName;
+    const QString databaseName;
+    QMutex mutex;
+    QWaitCondition queueChanged;
+    QWaitCondition idle;
+    std::deque<WriteJob> queue;
+    QAtomicInt pendingJobs = 0; //!< Both queued and being done right now
+    bool stopping = false;
+};
+
 Database::Database(const QString& userId, const QString& deviceId,
                    PicklingKey&& picklingKey)
     : m_userId(userId)
     , m_deviceId(deviceId)
     , m_picklingKey(std::move(picklingKey))
 {
-    auto db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"),
-                                        "Quotient_"_ls + m_userId);
+    m_database = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), "Quotient_"_ls + m_userId);
     auto dbDir = m_userId;
     dbDir.replace(u':', u'_');
     const QString databasePath{ QStandardPaths::writableLocation(
                                     QStandardPaths::AppDataLocation)
                                 % u'/' % dbDir };
     QDir(databasePath).mkpath("."_ls);
-    db.setDatabaseName(databasePath + "/quotient_%1.db3"_ls.arg(m_deviceId));
-    db.open(); // Further accessed via database()
+    m_database.setDatabaseName(databasePath + "/quotient_%1.db3"_ls.arg(m_deviceId));
+    m_database.open(); // Further accessed via database()
+    // With WAL, writes don't need to wait for readers and don't sync to disk
+    // on every commit; synchronous=NORMAL is still safe against corruption
+    // in this mode, the worst that can happen is losing the last transactions
+    // on a power failure
+    execute(QStringLiteral("PRAGMA journal_mode=WAL;"));
+    execute(QStringLiteral("PRAGMA synchronous=NORMAL;"));
+    execute(QStringLiteral("PRAGMA cache_size=-8192;")); // In KiB
+    execute(QStringLiteral("PRAGMA temp_store=MEMORY;"));
 
     switch(version()) {
     case 0: migrateTo1(); [[fallthrough]];
@@ -47,10 +158,35 @@ Database::Database(const QString& userId, const QString& deviceId,
     case 6: migrateTo7(); [[fallthrough]];
     case 7: migrateTo8(); [[fallthrough]];
     case 8: migrateTo9(); [[fallthrough]];
-    case 9: migrateTo10();
+    case 9: migrateTo10(); [[fallthrough]];
+    case 10: migrateTo11(); [[fallthrough]];
+    case 11: migrateTo12(); [[fallthrough]];
+    case 12: migrateTo13();
     }
 }
 
+Database::~Database()
+{
+    if (m_writerThread)
+        m_writerThread->stop();
+}
+
+void Database::enqueueWrite(WriteJob job)
+{
+    if (!m_writerThread) {
+        m_writerThread = std::make_unique<WriterThread>(m_database.connectionName() + "_writer"_ls,
+                                                        m_database.databaseName());
+        m_writerThread->start();
+    }
+    m_writerThread->enqueue(std::move(job));
+}
+
+void Database::waitForPendingWrites() const
+{
+    if (m_writerThread)
+        m_writerThread->waitForIdle();
+}
+
 int Database::version()
 {
     auto query = execute(QStringLiteral("PRAGMA user_version;"));
@@ -68,7 +204,13 @@ int Database::version()
 
 QSqlQuery Database::execute(const QString& queryString)
 {
+    waitForPendingWrites();
+    QElapsedTimer et;
+    et.start();
     QSqlQuery query(queryString, database());
+    ++m_statistics.prepares;
+    ++m_statistics.executes;
+    m_statistics.executeNsecs += et.nsecsElapsed();
     if (query.lastError().type() != QSqlError::NoError) {
         qCritical(DATABASE) << "Failed to execute query";
         qCritical(DATABASE) << query.lastQuery();
@@ -79,15 +221,27 @@ QSqlQuery Database::execute(const QString& queryString)
 
 void Database::execute(QSqlQuery& query)
 {
-    if (!query.exec()) {
-        qCritical(DATABASE) << "Failed to execute query";
-        qCritical(DATABASE) << query.lastQuery();
-        qCritical(DATABASE) << query.lastError();
-    }
+    waitForPendingWrites();
+    QElapsedTimer et;
+    et.start();
+    executeQuery(query);
+    ++m_statistics.executes;
+    m_statistics.executeNsecs += et.nsecsElapsed();
+}
+
+bool Database::executeQuery(QSqlQuery& query)
+{
+    if (query.exec())
+        return true;
+    qCritical(DATABASE) << "Failed to execute query";
+    qCritical(DATABASE) << query.lastQuery();
+    qCritical(DATABASE) << query.lastError();
+    return false;
 }
 
 void Database::transaction()
 {
+    waitForPendingWrites();
     database().transaction();
 }
 
@@ -274,6 +428,42 @@ void Database::migrateTo10()
 
 }
 
+void Database::migrateTo11()
+{
+    qCDebug(DATABASE) << "Migrating database to version 11";
+
+    transaction();
+    // Older versions could leave duplicate rows; keep the latest ones
+    execute(QStringLiteral("DELETE FROM tracked_users WHERE rowid NOT IN (SELECT MAX(rowid) FROM tracked_users GROUP BY matrixId);"));
+    execute(QStringLiteral("DELETE FROM outdated_users WHERE rowid NOT IN (SELECT MAX(rowid) FROM outdated_users GROUP BY matrixId);"));
+    execute(QStringLiteral("DELETE FROM tracked_devices WHERE rowid NOT IN (SELECT MAX(rowid) FROM tracked_devices GROUP BY matrixId, deviceId);"));
+    execute(QStringLiteral("CREATE UNIQUE INDEX tracked_users_idx ON tracked_users(matrixId);"));
+    execute(QStringLiteral("CREATE UNIQUE INDEX outdated_users_idx ON outdated_users(matrixId);"));
+    execute(QStringLiteral("CREATE UNIQUE INDEX tracked_devices_idx ON tracked_devices(matrixId, deviceId);"));
+    execute(QStringLiteral("pragma user_version = 11"));
+    commit();
+}
+
+void Database::migrateTo12()
+{
+    qCDebug(DATABASE) << "Migrating database to version 12";
+
+    transaction();
+    execute(QStringLiteral("CREATE INDEX sent_megolm_sessions_idx ON sent_megolm_sessions(roomId, sessionId, userId, deviceId);"));
+    execute(QStringLiteral("pragma user_version = 12"));
+    commit();
+}
+
+void Database::migrateTo13()
+{
+    qCDebug(DATABASE) << "Migrating database to version 13";
+
+    transaction();
+    execute(QStringLiteral("CREATE INDEX olm_sessions_sender_idx ON olm_sessions(senderKey, lastReceived);"));
+    execute(QStringLiteral("pragma user_version = 13"));
+    commit();
+}
+
 void Database::storeOlmAccount(const QOlmAccount& olmAccount)
 {
     auto deleteQuery = prepareQuery(QStringLiteral("DELETE FROM accounts;"));
@@ -327,13 +517,19 @@ void Database::saveOlmSession(const QByteArray& senderKey,
     commit();
 }
 
-std::unordered_map<QByteArray, std::vector<QOlmSession> > Database::loadOlmSessions()
+std::unordered_map<QByteArray, std::vector<QOlmSession> > Database::loadOlmSessions(
+    int maxPerSenderKey, int maxTotal)
 {
-    auto query = prepareQuery(QStringLiteral(
-        "SELECT * FROM olm_sessions ORDER BY lastReceived DESC;"));
-    transaction();
+    // -1 means no limit for SQLite's LIMIT; for the per-sender limit, the
+    // window function is only used when it's needed
+    auto query = prepareQuery(
+        maxPerSenderKey < 0
+            ? QStringLiteral("SELECT senderKey, pickle FROM olm_sessions ORDER BY lastReceived DESC LIMIT :maxTotal;")
+            : QStringLiteral("SELECT senderKey, pickle FROM (SELECT senderKey, pickle, lastReceived, ROW_NUMBER() OVER (PARTITION BY senderKey ORDER BY lastReceived DESC) AS n FROM olm_sessions) WHERE n <= :maxPerSenderKey ORDER BY lastReceived DESC LIMIT :maxTotal;"));
+    if (maxPerSenderKey >= 0)
+        query.bindValue(":maxPerSenderKey"_ls, maxPerSenderKey);
+    query.bindValue(":maxTotal"_ls, maxTotal);
     execute(query);
-    commit();
     std::unordered_map<QByteArray, std::vector<QOlmSession>> sessions;
     while (query.next()) {
         if (auto&& expectedSession =
@@ -348,6 +544,34 @@ std::unordered_map<QByteArray, std::vector<QOlmSession> > Database::loadOlmSessi
     return sessions;
 }
 
+std::vector<QOlmSession> Database::loadOlmSessions(const QByteArray& senderKey)
+{
+    auto query = prepareQuery(QStringLiteral(
+        "SELECT pickle FROM olm_sessions WHERE senderKey=:senderKey ORDER BY lastReceived DESC;"));
+    query.bindValue(":senderKey"_ls, senderKey);
+    execute(query);
+    std::vector<QOlmSession> sessions;
+    while (query.next()) {
+        if (auto&& expectedSession =
+                QOlmSession::unpickle(query.value("pickle"_ls).toByteArray(), m_picklingKey))
+            sessions.emplace_back(std::move(*expectedSession));
+        else
+            qCWarning(E2EE) << "Failed to unpickle olm session:" << expectedSession.error();
+    }
+    return sessions;
+}
+
+QHash<QByteArray, int> Database::olmSessionCounts()
+{
+    auto query = prepareQuery(
+        QStringLiteral("SELECT senderKey, COUNT(*) FROM olm_sessions GROUP BY senderKey;"));
+    execute(query);
+    QHash<QByteArray, int> counts;
+    while (query.next())
+        counts.insert(query.value(0).toByteArray(), query.value(1).toInt());
+    return counts;
+}
+
 std::unordered_map<QByteArray, QOlmInboundGroupSession> Database::loadMegolmSessions(
     const QString& roomId)
 {
@@ -384,6 +608,37 @@ std::unordered_map<QByteArray, QOlmInboundGroupSession> Database::loadMegolmSess
     return sessions;
 }
 
+std::optional<QOlmInboundGroupSession> Database::loadMegolmSession(const QString& roomId,
+                                                                   const QByteArray& sessionId)
+{
+    auto query = prepareQuery(QStringLiteral("SELECT pickle, olmSessionId, senderId FROM inbound_megolm_sessions WHERE roomId=:roomId AND sessionId=:sessionId;"));
+    query.bindValue(":roomId"_ls, roomId);
+    query.bindValue(":sessionId"_ls, sessionId);
+    execute(query);
+    if (!query.next())
+        return {};
+    auto&& expectedSession = QOlmInboundGroupSession::unpickle(
+        query.value("pickle"_ls).toByteArray(), m_picklingKey);
+    if (!expectedSession) {
+        qCWarning(E2EE) << "Failed to unpickle megolm session:" << expectedSession.error();
+        return {};
+    }
+    expectedSession->setOlmSessionId(query.value("olmSessionId"_ls).toByteArray());
+    expectedSession->setSenderId(query.value("senderId"_ls).toString());
+    return std::move(*expectedSession);
+}
+
+QSet<QByteArray> Database::megolmSessionIds(const QString& roomId)
+{
+    auto query = prepareQuery(QStringLiteral("SELECT sessionId FROM inbound_megolm_sessions WHERE roomId=:roomId;"));
+    query.bindValue(":roomId"_ls, roomId);
+    execute(query);
+    QSet<QByteArray> sessionIds;
+    while (query.next())
+        sessionIds.insert(query.value(0).toByteArray());
+    return sessionIds;
+}
+
 void Database::saveMegolmSession(const QString& roomId,
                                  const QOlmInboundGroupSession& session, const QByteArray &senderKey, const QByteArray& senderClaimedEdKey)
 {
@@ -433,16 +688,71 @@ std::pair<QString, qint64> Database::groupSessionIndexRecord(const QString& room
     return {query.value("eventId"_ls).toString(), query.value("ts"_ls).toLongLong()};
 }
 
+std::unordered_map<uint32_t, std::pair<QString, qint64>> Database::groupSessionIndexRecords(
+    const QString& roomId, const QString& sessionId)
+{
+    auto query = prepareQuery(QStringLiteral("SELECT i, eventId, ts FROM group_session_record_index WHERE roomId=:roomId AND sessionId=:sessionId;"));
+    query.bindValue(":roomId"_ls, roomId);
+    query.bindValue(":sessionId"_ls, sessionId);
+    execute(query);
+    std::unordered_map<uint32_t, std::pair<QString, qint64>> records;
+    while (query.next())
+        records.try_emplace(query.value("i"_ls).toUInt(), query.value("eventId"_ls).toString(),
+                            query.value("ts"_ls).toLongLong());
+    return records;
+}
+
+void Database::addGroupSessionIndexRecords(
+    const QString& roomId,
+    const QVector<std::tuple<QString, uint32_t, QString, qint64>>& records)
+{
+    auto query = prepareQuery("INSERT INTO group_session_record_index(roomId, sessionId, i, eventId, ts) VALUES(:roomId, :sessionId, :index, :eventId, :ts);"_ls);
+    transaction();
+    for (const auto& [sessionId, index, eventId, ts] : records) {
+        query.bindValue(":roomId"_ls, roomId);
+        query.bindValue(":sessionId"_ls, sessionId);
+        query.bindValue(":index"_ls, index);
+        query.bindValue(":eventId"_ls, eventId);
+        query.bindValue(":ts"_ls, ts);
+        execute(query);
+    }
+    commit();
+}
+
 QSqlDatabase Database::database() const
 {
-    return QSqlDatabase::database("Quotient_"_ls + m_userId);
+    return m_database;
 }
 
-QSqlQuery Database::prepareQuery(const QString& queryString) const
+// Copies of QSqlQuery share the prepared statement, which is exactly what
+// is needed here; Qt deprecates copying because of this sharing
+QT_WARNING_PUSH
+QT_WARNING_DISABLE_DEPRECATED
+Database::PreparedQuery::PreparedQuery(const QSqlQuery& query)
+    : QSqlQuery(query)
+{}
+QT_WARNING_POP
+
+Database::PreparedQuery Database::prepareQuery(const QString& queryString) const
 {
-    QSqlQuery query(database());
-    query.prepare(queryString);
-    return query;
+    waitForPendingWrites();
+    auto it = m_preparedQueries.find(queryString);
+    if (it != m_preparedQueries.end()) {
+        ++m_statistics.cachedPrepares;
+        // Reset the statement in case another query with it is still around
+        if (it->second.isActive())
+            it->second.finish();
+    } else {
+        QSqlQuery query(database());
+        ++m_statistics.prepares;
+        if (!query.prepare(queryString)) {
+            qCritical(DATABASE) << "Failed to prepare query" << queryString;
+            qCritical(DATABASE) << query.lastError();
+            return PreparedQuery(query); // Don't cache failures
+        }
+        it = m_preparedQueries.try_emplace(queryString, std::move(query)).first;
+    }
+    return PreparedQuery(it->second);
 }
 
 void Database::clearRoomData(const QString& roomId)
@@ -460,16 +770,40 @@ void Database::clearRoomData(const QString& roomId)
         execute(q);
     }
     commit();
+    m_devicesWithKey.erase(roomId);
 }
 
-void Database::setOlmSessionLastReceived(const QByteArray& sessionId, const QDateTime& timestamp)
+void Database::setOlmSessionsLastReceived(const QHash<QByteArray, QDateTime>& timestamps)
 {
-    auto query = prepareQuery(QStringLiteral("UPDATE olm_sessions SET lastReceived=:lastReceived WHERE sessionId=:sessionId;"));
-    query.bindValue(":lastReceived"_ls, timestamp);
-    query.bindValue(":sessionId"_ls, sessionId);
-    transaction();
-    execute(query);
-    commit();
+    if (timestamps.isEmpty())
+        return;
+    enqueueWrite([timestamps](QSqlDatabase& db) {
+        // Update all sessions with a single statement, or a few of them for many sessions,
+        // keeping the number of bound values well below SQLite limits
+        static constexpr qsizetype SessionsPerChunk = 64;
+        auto it = timestamps.cbegin();
+        for (auto remaining = timestamps.size(); remaining > 0;) {
+            const auto chunkSize = std::min(SessionsPerChunk, remaining);
+            remaining -= chunkSize;
+            QString queryString = QStringLiteral("UPDATE olm_sessions SET lastReceived=CASE sessionId");
+            for (qsizetype i = 0; i < chunkSize; ++i)
+                queryString += " WHEN ? THEN ?"_ls;
+            queryString += " END WHERE sessionId IN ("_ls;
+            for (qsizetype i = 0; i < chunkSize; ++i)
+                queryString += i > 0 ? ", ?"_ls : "?"_ls;
+            queryString += ");"_ls;
+            QSqlQuery query(db);
+            query.prepare(queryString);
+            const auto chunkEnd = std::next(it, chunkSize);
+            for (auto chunkIt = it; chunkIt != chunkEnd; ++chunkIt) {
+                query.addBindValue(chunkIt.key());
+                query.addBindValue(chunkIt.value());
+            }
+            for (; it != chunkEnd; ++it)
+                query.addBindValue(it.key());
+            executeQuery(query);
+        }
+    });
 }
 
 void Database::saveCurrentOutboundMegolmSession(const QString& roomId,
@@ -519,37 +853,92 @@ void Database::setDevicesReceivedKey(
     const QVector<std::tuple<QString, QString, QString>>& devices,
     const QByteArray& sessionId, uint32_t index)
 {
-    transaction();
-    for (const auto& [user, device, curveKey] : devices) {
-        auto query = prepareQuery(QStringLiteral("INSERT INTO sent_megolm_sessions(roomId, userId, deviceId, identityKey, sessionId, i) VALUES(:roomId, :userId, :deviceId, :identityKey, :sessionId, :i);"));
-        query.bindValue(":roomId"_ls, roomId);
-        query.bindValue(":userId"_ls, user);
-        query.bindValue(":deviceId"_ls, device);
-        query.bindValue(":identityKey"_ls, curveKey);
-        query.bindValue(":sessionId"_ls, sessionId);
-        query.bindValue(":i"_ls, index);
-        execute(query);
-    }
-    commit();
+    if (devices.isEmpty())
+        return;
+    if (auto it = m_devicesWithKey.find(roomId);
+        it != m_devicesWithKey.end() && it->second.sessionId == sessionId)
+        for (const auto& [user, device, curveKey] : devices)
+            it->second.devices.insert({ user, device });
+
+    enqueueWrite([roomId, devices, sessionId, index](QSqlDatabase& db) {
+        // Insert in chunks of several rows per statement, keeping the number
+        // of bound values well below SQLite limits
+        static constexpr qsizetype RowsPerChunk = 64;
+        const auto prepareInsert = [&db](qsizetype rows) {
+            QString queryString = QStringLiteral("INSERT INTO sent_megolm_sessions(roomId, userId, deviceId, identityKey, sessionId, i) VALUES");
+            for (qsizetype i = 0; i < rows; ++i) {
+                if (i > 0)
+                    queryString += u',';
+                queryString += "(?, ?, ?, ?, ?, ?)"_ls;
+            }
+            QSqlQuery query(db);
+            query.prepare(queryString);
+            return query;
+        };
+        auto chunkQuery = devices.size() >= RowsPerChunk ? prepareInsert(RowsPerChunk) : QSqlQuery();
+        auto rowQuery = prepareInsert(1);
+        for (qsizetype chunkStart = 0; chunkStart < devices.size(); chunkStart += RowsPerChunk) {
+            const auto chunkSize = std::min(RowsPerChunk, devices.size() - chunkStart);
+            auto& query = chunkSize == RowsPerChunk ? chunkQuery : rowQuery;
+            for (qsizetype i = chunkStart; i < chunkStart + chunkSize; ++i) {
+                const auto& [user, device, curveKey] = devices[i];
+                query.addBindValue(roomId);
+                query.addBindValue(user);
+                query.addBindValue(device);
+                query.addBindValue(curveKey);
+                query.addBindValue(sessionId);
+                query.addBindValue(index);
+                if (chunkSize < RowsPerChunk)
+                    executeQuery(query);
+            }
+            if (chunkSize == RowsPerChunk)
+                executeQuery(query);
+        }
+    });
 }
 
 QMultiHash<QString, QString> Database::devicesWithoutKey(
     const QString& roomId, QMultiHash<QString, QString> devices,
     const QByteArray& sessionId)
 {
-    auto query = prepareQuery(QStringLiteral("SELECT userId, deviceId FROM sent_megolm_sessions WHERE roomId=:roomId AND sessionId=:sessionId"));
-    query.bindValue(":roomId"_ls, roomId);
-    query.bindValue(":sessionId"_ls, sessionId);
-    transaction();
-    execute(query);
-    commit();
-    while (query.next()) {
-        devices.remove(query.value("userId"_ls).toString(),
-                       query.value("deviceId"_ls).toString());
+    auto& devicesWithKey = m_devicesWithKey[roomId];
+    if (devicesWithKey.sessionId != sessionId) {
+        // Only the current outbound session of the room is kept in memory
+        devicesWithKey = { sessionId, {} };
+        auto query = prepareQuery(QStringLiteral("SELECT userId, deviceId FROM sent_megolm_sessions WHERE roomId=:roomId AND sessionId=:sessionId"));
+        query.bindValue(":roomId"_ls, roomId);
+        query.bindValue(":sessionId"_ls, sessionId);
+        execute(query);
+        while (query.next())
+            devicesWithKey.devices.insert(
+                { query.value("userId"_ls).toString(), query.value("deviceId"_ls).toString() });
     }
+    devices.removeIf([&devicesWithKey](QMultiHash<QString, QString>::iterator it) {
+        return devicesWithKey.devices.contains({ it.key(), it.value() });
+    });
     return devices;
 }
 
+void Database::updateOlmSessions(
+    const std::vector<std::pair<QByteArray, const QOlmSession*>>& sessions)
+{
+    // Pickling needs the session itself and is done right away
+    QVector<std::tuple<QByteArray, QByteArray, QByteArray>> pickles;
+    pickles.reserve(qsizetype(sessions.size()));
+    for (const auto& [senderKey, session] : sessions)
+        pickles.push_back({ senderKey, session->sessionId(), session->pickle(m_picklingKey) });
+    enqueueWrite([pickles](QSqlDatabase& db) {
+        QSqlQuery query(db);
+        query.prepare(QStringLiteral("UPDATE olm_sessions SET pickle=:pickle WHERE senderKey=:senderKey AND sessionId=:sessionId;"));
+        for (const auto& [senderKey, sessionId, pickle] : pickles) {
+            query.bindValue(":pickle"_ls, pickle);
+            query.bindValue(":senderKey"_ls, senderKey);
+            query.bindValue(":sessionId"_ls, sessionId);
+            executeQuery(query);
+        }
+    });
+}
+
 void Database::updateOlmSession(const QByteArray& senderKey,
                                 const QOlmSession& session)
 {
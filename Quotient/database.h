@@ -4,10 +4,15 @@
 #pragma once
 
 #include <QtCore/QObject>
+#include <QtSql/QSqlDatabase>
 #include <QtSql/QSqlQuery>
 #include <QtCore/QVector>
 
 #include <QtCore/QHash>
+#include <QtCore/QSet>
+
+#include <functional>
+#include <memory>
 
 #include "e2ee/e2ee_common.h"
 
@@ -23,6 +28,17 @@ class QUOTIENT_API Database
 public:
     Database(const QString& userId, const QString& deviceId,
              PicklingKey&& picklingKey);
+    ~Database();
+
+    //! A write to be done in the database thread, using its own connection
+    using WriteJob = std::function<void(QSqlDatabase&)>;
+
+    struct Statistics {
+        quint64 prepares = 0; //!< Statements actually prepared by SQLite
+        quint64 cachedPrepares = 0; //!< prepareQuery() calls served from the cache
+        quint64 executes = 0;
+        qint64 executeNsecs = 0; //!< Time spent in executing statements
+    };
 
     int version();
     void transaction();
@@ -30,16 +46,71 @@ public:
     QSqlQuery execute(const QString &queryString);
     void execute(QSqlQuery &query);
     QSqlDatabase database() const;
-    QSqlQuery prepareQuery(const QString& queryString) const;
+    //! \brief A prepared query shared with the statement cache
+    //!
+    //! The statement is reset when the object goes out of scope or is assigned
+    //! another query; with WAL, a statement left active keeps its read
+    //! transaction open and the connection doesn't see newer commits, so
+    //! don't keep these around for longer than a single use.
+    class QUOTIENT_API PreparedQuery : public QSqlQuery {
+    public:
+        PreparedQuery(const PreparedQuery&) = delete;
+        PreparedQuery& operator=(PreparedQuery&& other) noexcept
+        {
+            swap(other); // other resets the previous statement
+            return *this;
+        }
+        ~PreparedQuery() { finish(); }
+
+    private:
+        friend class Database;
+        explicit PreparedQuery(const QSqlQuery& query);
+    };
+
+    //! \brief Get a prepared query for the given SQL
+    //!
+    //! Prepared statements are cached by their SQL text, and the returned
+    //! query shares the statement with the cache. Bind all the values every
+    //! time, and don't keep using the query after preparing the same SQL again.
+    PreparedQuery prepareQuery(const QString& queryString) const;
+    const Statistics& statistics() const { return m_statistics; }
+    //! Execute a query on any connection, logging a failure
+    static bool executeQuery(QSqlQuery& query);
+
+    //! \brief Queue a write to be done in the database thread
+    //!
+    //! \p job should only use the database connection it gets and the data
+    //! it captured by value; all jobs queued by the time the database thread
+    //! gets to them are done in a single transaction. Failures are logged.
+    //!
+    //! Other methods of Database wait until all queued writes are done,
+    //! so that what they read or write is always consistent with those.
+    void enqueueWrite(WriteJob job);
+    //! Wait until all queued writes are done
+    void waitForPendingWrites() const;
 
     void storeOlmAccount(const QOlmAccount& olmAccount);
     std::optional<OlmErrorCode> setupOlmAccount(QOlmAccount &olmAccount);
     void clear();
     void saveOlmSession(const QByteArray& senderKey, const QOlmSession& session,
                         const QDateTime& timestamp);
-    std::unordered_map<QByteArray, std::vector<QOlmSession>> loadOlmSessions();
+    //! \brief Load the most recently used Olm sessions
+    //! \param maxPerSenderKey the number of sessions to load for each sender
+    //!        key; -1 to load all
+    //! \param maxTotal the total number of sessions to load; -1 to load all
+    std::unordered_map<QByteArray, std::vector<QOlmSession>> loadOlmSessions(
+        int maxPerSenderKey = -1, int maxTotal = -1);
+    //! Load all Olm sessions with the sender key, the most recently used first
+    std::vector<QOlmSession> loadOlmSessions(const QByteArray& senderKey);
+    //! Get the numbers of stored Olm sessions by sender key
+    QHash<QByteArray, int> olmSessionCounts();
     std::unordered_map<QByteArray, QOlmInboundGroupSession> loadMegolmSessions(
         const QString& roomId);
+    //! Load a single inbound megolm session; std::nullopt if it's not found
+    std::optional<QOlmInboundGroupSession> loadMegolmSession(const QString& roomId,
+                                                             const QByteArray& sessionId);
+    //! Get ids of all inbound megolm sessions of the room, without unpickling them
+    QSet<QByteArray> megolmSessionIds(const QString& roomId);
     void saveMegolmSession(const QString& roomId,
                            const QOlmInboundGroupSession& session,
                            const QByteArray& senderKey,
@@ -50,20 +121,31 @@ public:
     std::pair<QString, qint64> groupSessionIndexRecord(const QString& roomId,
                                                        const QString& sessionId,
                                                        qint64 index);
+    // Returns a map index -> {eventId, ts} with all records for the session
+    std::unordered_map<uint32_t, std::pair<QString, qint64>> groupSessionIndexRecords(
+        const QString& roomId, const QString& sessionId);
+    // 'records' contains tuples {sessionId, index, eventId, ts}
+    void addGroupSessionIndexRecords(
+        const QString& roomId,
+        const QVector<std::tuple<QString, uint32_t, QString, qint64>>& records);
     void clearRoomData(const QString& roomId);
-    void setOlmSessionLastReceived(const QByteArray& sessionId,
-                                   const QDateTime& timestamp);
+    //! Queue updates of last received times of several sessions, by session id
+    void setOlmSessionsLastReceived(const QHash<QByteArray, QDateTime>& timestamps);
     std::optional<QOlmOutboundGroupSession> loadCurrentOutboundMegolmSession(const QString& roomId);
     void saveCurrentOutboundMegolmSession(
         const QString& roomId, const QOlmOutboundGroupSession& session);
     void updateOlmSession(const QByteArray& senderKey,
                           const QOlmSession& session);
+    //! Queue saving the state of several Olm sessions, given with their sender keys
+    void updateOlmSessions(
+        const std::vector<std::pair<QByteArray, const QOlmSession*>>& sessions);
 
     // Returns a map UserId -> [DeviceId] that have not received key yet
     QMultiHash<QString, QString> devicesWithoutKey(
         const QString& roomId, QMultiHash<QString, QString> devices,
         const QByteArray& sessionId);
-    // 'devices' contains tuples {userId, deviceId, curveKey}
+    // 'devices' contains tuples {userId, deviceId, curveKey}; this is queued
+    // to the database thread
     void setDevicesReceivedKey(
         const QString& roomId,
         const QVector<std::tuple<QString, QString, QString>>& devices,
@@ -94,9 +176,23 @@ private:
     void migrateTo8();
     void migrateTo9();
     void migrateTo10();
+    void migrateTo11();
+    void migrateTo12();
+    void migrateTo13();
 
     QString m_userId;
     QString m_deviceId;
     PicklingKey m_picklingKey;
+    QSqlDatabase m_database;
+    mutable std::unordered_map<QString, QSqlQuery> m_preparedQueries;
+    mutable Statistics m_statistics;
+    class WriterThread;
+    std::unique_ptr<WriterThread> m_writerThread;
+    struct DevicesWithKey {
+        QByteArray sessionId;
+        QSet<std::pair<QString, QString>> devices; //!< {userId, deviceId}
+    };
+    //! Devices that received the current outbound megolm session, by room id
+    std::unordered_map<QString, DevicesWithKey> m_devicesWithKey;
 };
 } // namespace Quotient
@@ -0,0 +1,181 @@
+// SPDX-FileCopyrightText: 2026 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <QtCore/QtGlobal>
+
+#include <algorithm>
+#include <vector>
+
+namespace Quotient::_impl {
+
+//! \brief Running totals of notable and highlighted events in a room timeline
+//!
+//! Timeline indices grow up from 0 for new events and go down from -1 for
+//! historical ones; the totals are kept for either side separately and are
+//! counted away from 0, so that adding events at either end of the timeline
+//! leaves the totals already stored intact. Counts over any range of indices
+//! are then a difference of two totals. When an event in the middle of the
+//! timeline changes (e.g., gets redacted or decrypted), the totals past it are
+//! recalculated lazily, on the next query.
+class EventCounters {
+public:
+    using index_t = int;
+
+    struct Counts {
+        qsizetype notable = 0;
+        qsizetype highlight = 0;
+
+        Counts& operator+=(const Counts& other)
+        {
+            notable += other.notable;
+            highlight += other.highlight;
+            return *this;
+        }
+        friend Counts operator-(const Counts& lhs, const Counts& rhs)
+        {
+            return { lhs.notable - rhs.notable, lhs.highlight - rhs.highlight };
+        }
+    };
+
+    //! \brief Add counts for the event at \p index, next to either end of the timeline
+    //!
+    //! Events loaded back after unloadBefore() are added in the same way.
+    void add(index_t index, bool notable, bool highlight)
+    {
+        auto& side = index >= 0 ? newer : older;
+        const auto pos = positionOf(index);
+        if (pos >= side.offset && pos - side.offset < side.items.size()) { // Already counted
+            update(index, notable, highlight);
+            return;
+        }
+        const auto item = pack(notable, highlight);
+        if (pos + 1 == side.offset) {
+            // Loaded back next to the unloaded part; rebase so that the totals past it stay intact
+            side.items.insert(side.items.begin(), item);
+            side.totals.insert(side.totals.begin(), side.base);
+            side.base = side.base - unpack(item);
+            --side.offset;
+            ++side.validTotals;
+            return;
+        }
+        Q_ASSERT(pos == side.offset + side.items.size());
+        const auto n = side.items.size();
+        side.items.push_back(item);
+        if (side.validTotals < n) { // Will be calculated on the next query
+            side.totals.emplace_back();
+            return;
+        }
+        side.totals.push_back(total(side, pos));
+        side.totals.back() += unpack(item);
+        ++side.validTotals;
+    }
+
+    //! Update counts for the event at \p index that is already in the timeline
+    void update(index_t index, bool notable, bool highlight)
+    {
+        auto& side = index >= 0 ? newer : older;
+        const auto k = positionOf(index) - side.offset;
+        Q_ASSERT(positionOf(index) >= side.offset && k < side.items.size());
+        if (const auto item = pack(notable, highlight); side.items[k] != item) {
+            side.items[k] = item;
+            side.validTotals = std::min(side.validTotals, k);
+        }
+    }
+
+    //! \brief Forget counts for indices below \p index
+    //!
+    //! Counts for the remaining indices are rebased on the total of what's
+    //! dropped, so that neither side keeps anything for the unloaded events.
+    void unloadBefore(index_t index)
+    {
+        // The older side loses its far end, indices below index
+        const auto olderKeep = index >= 0 ? 0 : size_t(-index);
+        if (olderKeep < older.offset + older.items.size()) {
+            const auto keepCount = olderKeep > older.offset ? olderKeep - older.offset : 0;
+            older.items.resize(keepCount);
+            older.totals.resize(keepCount);
+            older.validTotals = std::min(older.validTotals, keepCount);
+            older.items.shrink_to_fit();
+            older.totals.shrink_to_fit();
+        }
+        // The newer side loses its beginning, so its totals need rebasing
+        if (index <= 0 || size_t(index) <= newer.offset)
+            return;
+        const auto dropCount = std::min(size_t(index) - newer.offset, newer.items.size());
+        newer.base = total(newer, newer.offset + dropCount);
+        newer.items.erase(newer.items.begin(), newer.items.begin() + ptrdiff_t(dropCount));
+        newer.totals.erase(newer.totals.begin(), newer.totals.begin() + ptrdiff_t(dropCount));
+        newer.validTotals -= dropCount;
+        newer.offset += dropCount;
+        newer.items.shrink_to_fit();
+        newer.totals.shrink_to_fit();
+    }
+
+    //! \brief Get counts over the range of indices [\p first, \p last]
+    //!
+    //! \p last may be one less than \p first, for an empty range.
+    Counts inRange(index_t first, index_t last) const
+    {
+        Q_ASSERT(first <= last + 1);
+        return signedTotal(last + 1) - signedTotal(first);
+    }
+
+private:
+    enum : quint8 { Notable = 0x1, Highlight = 0x2 };
+
+    struct Side {
+        //! Counts for the events at positions starting from offset
+        std::vector<quint8> items;
+        //! totals[k] is base plus the sum of items[0..k]; only the first
+        //! validTotals of them are up to date
+        mutable std::vector<Counts> totals;
+        mutable size_t validTotals = 0;
+        //! The number of positions (counted away from 0) not in items
+        size_t offset = 0;
+        //! The total for the positions below offset, as of the time they were unloaded
+        Counts base;
+    };
+    Side newer; //!< Indices 0, 1, 2...
+    Side older; //!< Indices -1, -2, -3...
+
+    static quint8 pack(bool notable, bool highlight)
+    {
+        return quint8((notable ? Notable : 0) | (highlight ? Highlight : 0));
+    }
+    static Counts unpack(quint8 item)
+    {
+        return { (item & Notable) != 0, (item & Highlight) != 0 };
+    }
+    static size_t positionOf(index_t index)
+    {
+        return index >= 0 ? size_t(index) : size_t(-index - 1);
+    }
+
+    //! Sum up the items of the side at the first \p n positions
+    static Counts total(const Side& side, size_t n)
+    {
+        Q_ASSERT(n >= side.offset && n - side.offset <= side.items.size());
+        if (n == side.offset)
+            return side.base;
+        for (; side.validTotals < n - side.offset; ++side.validTotals) {
+            const auto k = side.validTotals;
+            side.totals[k] = k == 0 ? side.base : side.totals[k - 1];
+            side.totals[k] += unpack(side.items[k]);
+        }
+        return side.totals[n - side.offset - 1];
+    }
+
+    //! Counts over [0, \p index) for non-negative \p index, negated counts over [\p index, 0) otherwise
+    Counts signedTotal(index_t index) const
+    {
+        // Once the newer side is rebased, its totals only line up with those of the older side
+        // after subtracting the total at 0; until the position 0 is loaded back, the older side
+        // is empty and that doesn't matter
+        return index >= 0 ? total(newer, size_t(index)) - (newer.offset == 0 ? newer.base : Counts())
+                          : Counts() - total(older, size_t(-index));
+    }
+};
+
+} // namespace Quotient::_impl
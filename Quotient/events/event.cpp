@@ -6,10 +6,88 @@
 #include "../logging_categories_p.h"
 #include "stateevent.h"
 
+#include <QtCore/QCborMap>
+#include <QtCore/QMutex>
 #include <QtCore/QJsonDocument>
 
+#include <private/qjson_p.h>
+
 using namespace Quotient;
 
+//! \brief Candidate metatypes to try, in order, when loading derived events
+//!
+//! Walking the type hierarchy as described for EventMetaType::loadFrom() tries
+//! specific types with the matching TypeId and base types with isValid(), in
+//! the depth-first order, with derived types of a base type going before
+//! the base type itself. The table stores that order for each Matrix type
+//! known in the hierarchy; the order for other Matrix types only has base
+//! types with isValid().
+struct AbstractEventMetaType::DispatchTable {
+    std::unordered_map<QString, std::vector<const AbstractEventMetaType*>> candidatesByType;
+    std::vector<const AbstractEventMetaType*> baseCandidates;
+};
+
+namespace {
+QMutex& dispatchTablesMutex()
+{
+    static QMutex m;
+    return m;
+}
+}
+
+AbstractEventMetaType::~AbstractEventMetaType() = default;
+
+void AbstractEventMetaType::collectCandidates(
+    std::vector<const AbstractEventMetaType*>& candidates) const
+{
+    for (const auto* t : derivedTypes) {
+        if (t->isSpecific()) {
+            candidates.push_back(t);
+            continue;
+        }
+        t->collectCandidates(candidates);
+        if (t->hasValidator())
+            candidates.push_back(t);
+    }
+}
+
+const AbstractEventMetaType::DispatchTable* AbstractEventMetaType::buildDispatchTable() const
+{
+    const QMutexLocker l { &dispatchTablesMutex() };
+    if (const auto* table = dispatchTable.load(std::memory_order_acquire))
+        return table; // Another thread has just built it
+
+    std::vector<const AbstractEventMetaType*> allCandidates;
+    collectCandidates(allCandidates);
+    auto table = std::make_unique<DispatchTable>();
+    for (const auto* t : allCandidates)
+        if (!t->isSpecific())
+            table->baseCandidates.push_back(t);
+        else if (!table->candidatesByType.contains(t->matrixId)) {
+            auto& typeCandidates = table->candidatesByType[t->matrixId];
+            std::ranges::copy_if(allCandidates, std::back_inserter(typeCandidates),
+                                 [t](const AbstractEventMetaType* c) {
+                                     return !c->isSpecific() || c->matrixId == t->matrixId;
+                                 });
+        }
+    const auto* result = dispatchTables.emplace_back(std::move(table)).get();
+    dispatchTable.store(result, std::memory_order_release);
+    return result;
+}
+
+Event* AbstractEventMetaType::loadFromDerived(const QJsonObject& fullJson,
+                                              const QString& type) const
+{
+    const auto* table = dispatchTable.load(std::memory_order_acquire);
+    if (Q_UNLIKELY(!table))
+        table = buildDispatchTable();
+    const auto it = table->candidatesByType.find(type);
+    for (const auto* t : it != table->candidatesByType.cend() ? it->second : table->baseCandidates)
+        if (auto* event = t->tryCreate(fullJson))
+            return event;
+    return nullptr;
+}
+
 void AbstractEventMetaType::addDerived(const AbstractEventMetaType* newType)
 {
     if (const auto existing =
@@ -37,7 +115,13 @@ void AbstractEventMetaType::addDerived(const AbstractEventMetaType* newType)
             << "; unless the two have different isValid() conditions, the "
                "latter class will never be used";
     }
-    derivedTypes.emplace_back(newType);
+    {
+        const QMutexLocker l { &dispatchTablesMutex() };
+        derivedTypes.emplace_back(newType);
+        // Tables of this type and its bases have to be rebuilt
+        for (const auto* t = this; t != nullptr; t = t->baseType)
+            t->dispatchTable.store(nullptr, std::memory_order_release);
+    }
     qDebug(EVENTS).nospace()
         << newType->matrixId << " -> " << newType->className << "; "
         << derivedTypes.size() << " derived type(s) registered for "
@@ -56,7 +140,40 @@ Event::Event(const QJsonObject& json)
 
 Event::~Event() = default;
 
-QString Event::matrixType() const { return fullJson()[TypeKey].toString(); }
+QString Event::matrixType() const
+{
+    return isJsonCompacted() ? _compactData->type : _json.value(TypeKey).toString();
+}
+
+void Event::compactJson(StringPool* pool) const
+{
+    if (isJsonCompacted())
+        return;
+    auto data = makeCompactData();
+    data->packedJson = QCborMap::fromJsonObject(_json).toCborValue().toCbor();
+    data->type = _json.value(TypeKey).toString();
+    _compactData = std::move(data);
+    _json = {};
+    if (pool)
+        internStrings(*pool);
+}
+
+std::unique_ptr<Event::CompactData> Event::makeCompactData() const
+{
+    return std::make_unique<CompactData>();
+}
+
+void Event::internStrings(StringPool& pool) const
+{
+    _compactData->type = pool.intern(_compactData->type);
+}
+
+void Event::unpackJson() const
+{
+    _json = QJsonPrivate::Value::fromTrustedCbor(QCborValue::fromCbor(_compactData->packedJson))
+                .toObject();
+    _compactData.reset();
+}
 
 const QJsonObject Event::contentJson() const
 {
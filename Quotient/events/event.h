@@ -7,6 +7,8 @@
 #include <Quotient/function_traits.h>
 #include "single_key_value.h"
 
+#include <atomic>
+
 namespace Quotient {
 // === event_ptr_tt<> and basic type casting facilities ===
 
@@ -56,7 +58,7 @@ public:
 
     void addDerived(const AbstractEventMetaType* newType);
 
-    virtual ~AbstractEventMetaType() = default;
+    virtual ~AbstractEventMetaType();
 
 protected:
     // Allow template specialisations to call into one another
@@ -68,8 +70,33 @@ protected:
     virtual bool doLoadFrom(const QJsonObject& fullJson, const QString& type,
                             Event*& event) const = 0;
 
+    //! Whether this is a metatype of a specific event type (one with TypeId)
+    virtual bool isSpecific() const = 0;
+    //! Whether the event type has a static isValid() predicate
+    virtual bool hasValidator() const = 0;
+    //! Create an event object if the JSON passes isValid(), if there's one
+    virtual Event* tryCreate(const QJsonObject& fullJson) const = 0;
+
+    //! \brief Create an event of the first matching type derived from this one
+    //!
+    //! This gives the same result as the lookup over derivedTypes in
+    //! doLoadFrom() but instead of walking the type hierarchy for each event,
+    //! it uses a flat table from Matrix types to candidate metatypes built on
+    //! the first call (and rebuilt if more types are registered afterwards).
+    //! \return the event object, or nullptr if no derived type matched
+    Event* loadFromDerived(const QJsonObject& fullJson, const QString& type) const;
+
 private:
+    struct DispatchTable;
+
     std::vector<const AbstractEventMetaType*> derivedTypes{};
+    mutable std::atomic<const DispatchTable*> dispatchTable = nullptr;
+    //! All tables ever built for this metatype; previous ones are kept
+    //! in case other threads still use them
+    mutable std::vector<std::unique_ptr<const DispatchTable>> dispatchTables;
+
+    const DispatchTable* buildDispatchTable() const;
+    void collectCandidates(std::vector<const AbstractEventMetaType*>& candidates) const;
     Q_DISABLE_COPY_MOVE(AbstractEventMetaType)
 };
 
@@ -128,8 +155,33 @@ public:
     //!       (i.e., Event). If no matching type derived from RoomEvent is found,
     //!       the nested lookup returns nullptr rather than a generic RoomEvent,
     //!       so that other types derived from Event could be examined.
+    //!
+    //! Rather than literally recursing into derivedTypes for every event, this
+    //! function takes the ordered list of candidate types for \p type from
+    //! a table flattening the above algorithm (see loadFromDerived()); the
+    //! recursive version is still available as loadByTraversal().
     event_ptr_tt<EventT> loadFrom(const QJsonObject& fullJson,
                                   const QString& type) const
+    {
+        Event* event = nullptr;
+        if constexpr (requires { EventT::TypeId; }) {
+            if (EventT::TypeId == type)
+                event = tryCreate(fullJson);
+        } else {
+            event = loadFromDerived(fullJson, type);
+            Q_ASSERT(!event || is<EventT>(*event));
+            if (!event) // Step 4 on the top level
+                event = tryCreate(fullJson);
+        }
+        return event_ptr_tt<EventT>{ static_cast<EventT*>(event) };
+    }
+
+    //! \brief Same as loadFrom() but walking the type hierarchy for each event
+    //!
+    //! This is the reference implementation of type resolution described for
+    //! loadFrom(); it is slower and is only kept for testing and benchmarking.
+    event_ptr_tt<EventT> loadByTraversal(const QJsonObject& fullJson,
+                                         const QString& type) const
     {
         Event* event = nullptr;
         const bool goodEnough = doLoadFrom(fullJson, type, event);
@@ -139,6 +191,17 @@ public:
     }
 
 private:
+    bool isSpecific() const override { return requires { EventT::TypeId; }; }
+    bool hasValidator() const override { return requires { EventT::isValid; }; }
+    Event* tryCreate(const QJsonObject& fullJson) const override
+    {
+        if constexpr (requires { EventT::isValid; }) {
+            if (!EventT::isValid(fullJson))
+                return nullptr;
+        }
+        return new EventT(fullJson);
+    }
+
     bool doLoadFrom(const QJsonObject& fullJson, const QString& type,
                     Event*& event) const override
     {
@@ -284,7 +347,29 @@ public:
     template <typename... VisitorTs>
     auto switchOnType(VisitorTs&&... visitors) const;
 
-    const QJsonObject& fullJson() const { return _json; }
+    const QJsonObject& fullJson() const
+    {
+        if (Q_UNLIKELY(isJsonCompacted()))
+            unpackJson();
+        return _json;
+    }
+
+    //! \brief Store the event JSON in a compact form until it's needed again
+    //!
+    //! The JSON is packed into CBOR and only unpacked (and kept unpacked) once
+    //! fullJson() or anything depending on it, such as contentJson(), is
+    //! called. While the JSON is packed, the most used fields (matrixType(),
+    //! as well as RoomEvent::id(), RoomEvent::senderId(),
+    //! RoomEvent::originTimestamp(), RoomEvent::stateKey() and
+    //! RoomEvent::relation()) are kept outside of it, so reading them doesn't
+    //! unpack the JSON; if \p pool is given, these strings share storage with
+    //! their equivalents from it. This saves memory on events that are kept
+    //! around but rarely looked into; events that are not compacted have
+    //! nothing but their JSON.
+    //! \note As fullJson() unpacks the JSON on a compacted event, it is not
+    //!       safe to call it on the same event from several threads at once.
+    void compactJson(StringPool* pool = nullptr) const;
+    bool isJsonCompacted() const { return bool(_compactData); }
 
     // According to the CS API spec, every event also has
     // a "content" object; but since its structure is different for
@@ -338,11 +423,39 @@ protected:
 
     explicit Event(const QJsonObject& json);
 
-    QJsonObject& editJson() { return _json; }
+    QJsonObject& editJson()
+    {
+        if (isJsonCompacted())
+            unpackJson();
+        return _json;
+    }
     virtual void dumpTo(QDebug dbg) const;
 
+    //! \brief What a compacted event keeps instead of its JSON
+    //!
+    //! Event classes that keep more fields outside of the packed JSON derive
+    //! from this (or from the structure of their base class) and override
+    //! makeCompactData() and internStrings().
+    struct CompactData {
+        virtual ~CompactData() = default;
+        QByteArray packedJson; //!< CBOR of the event JSON
+        QString type;
+    };
+    //! \brief Make the compact data for this event
+    //!
+    //! This is called by compactJson() while the JSON is still unpacked; the
+    //! fields of CompactData itself are filled by compactJson().
+    virtual std::unique_ptr<CompactData> makeCompactData() const;
+    //! Make the strings in the compact data share storage with \p pool
+    virtual void internStrings(StringPool& pool) const;
+    //! The compact data of the event; nullptr if the JSON is not compacted
+    CompactData* compactData() const { return _compactData.get(); }
+
 private:
-    QJsonObject _json;
+    mutable QJsonObject _json;
+    mutable std::unique_ptr<CompactData> _compactData;
+
+    void unpackJson() const;
 };
 using EventPtr = event_ptr_tt<Event>;
 
@@ -19,10 +19,17 @@ RoomEvent::RoomEvent(const QJsonObject& json) : Event(json)
 
 RoomEvent::~RoomEvent() = default; // Let the smart pointer do its job
 
-QString RoomEvent::id() const { return fullJson()[EventIdKey].toString(); }
+QString RoomEvent::id() const
+{
+    if (const auto* data = compactData())
+        return data->id;
+    return fullJson()[EventIdKey].toString();
+}
 
 QDateTime RoomEvent::originTimestamp() const
 {
+    if (const auto* data = compactData())
+        return QDateTime::fromMSecsSinceEpoch(data->originTimestamp, Qt::UTC);
     return Quotient::fromJson<QDateTime>(fullJson()["origin_server_ts"_ls]);
 }
 
@@ -33,6 +40,8 @@ QString RoomEvent::roomId() const
 
 QString RoomEvent::senderId() const
 {
+    if (const auto* data = compactData())
+        return data->senderId;
     return fullJson()[SenderKey].toString();
 }
 
@@ -48,9 +57,18 @@ QString RoomEvent::transactionId() const
 
 QString RoomEvent::stateKey() const
 {
+    if (const auto* data = compactData())
+        return data->stateKey;
     return fullJson()[StateKeyKey].toString();
 }
 
+std::optional<EventRelation> RoomEvent::relation() const
+{
+    if (const auto* data = compactData())
+        return data->relation;
+    return fromJson<std::optional<EventRelation>>(contentJson()[RelatesToKey]);
+}
+
 void RoomEvent::setRoomId(const QString& roomId)
 {
     editJson().insert(RoomIdKey, roomId);
@@ -78,6 +96,29 @@ void RoomEvent::addId(const QString& newId)
     Q_ASSERT(id() == newId);
 }
 
+std::unique_ptr<Event::CompactData> RoomEvent::makeCompactData() const
+{
+    const auto& json = fullJson();
+    auto data = std::make_unique<CompactData>();
+    data->id = json[EventIdKey].toString();
+    data->senderId = json[SenderKey].toString();
+    data->stateKey = json[StateKeyKey].toString();
+    data->originTimestamp = Quotient::fromJson<qint64>(json["origin_server_ts"_ls]);
+    data->relation = fromJson<std::optional<EventRelation>>(
+        json[ContentKey].toObject().value(RelatesToKey));
+    return data;
+}
+
+void RoomEvent::internStrings(StringPool& pool) const
+{
+    Event::internStrings(pool);
+    auto* data = compactData();
+    data->senderId = pool.intern(data->senderId);
+    data->stateKey = pool.intern(data->stateKey);
+    if (data->relation)
+        data->relation->type = pool.intern(data->relation->type);
+}
+
 void RoomEvent::dumpTo(QDebug dbg) const
 {
     Event::dumpTo(dbg);
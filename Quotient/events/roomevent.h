@@ -4,6 +4,7 @@
 #pragma once
 
 #include "event.h"
+#include "eventrelation.h"
 
 #include <QtCore/QDateTime>
 
@@ -39,6 +40,8 @@ public:
     QString redactionReason() const;
     QString transactionId() const;
     QString stateKey() const;
+    //! The relation of the event from its `m.relates_to` content, if any
+    std::optional<EventRelation> relation() const;
 
     //! \brief Fill the pending event object with the room id
     void setRoomId(const QString& roomId);
@@ -67,6 +70,20 @@ protected:
     explicit RoomEvent(const QJsonObject& json);
     void dumpTo(QDebug dbg) const override;
 
+    struct CompactData : Event::CompactData {
+        QString id;
+        QString senderId;
+        QString stateKey;
+        qint64 originTimestamp = 0;
+        std::optional<EventRelation> relation;
+    };
+    std::unique_ptr<Event::CompactData> makeCompactData() const override;
+    void internStrings(StringPool& pool) const override;
+    CompactData* compactData() const
+    {
+        return static_cast<CompactData*>(Event::compactData());
+    }
+
 private:
     // RedactionEvent is an incomplete type here so we cannot inline
     // constructors using it and also destructors (with 'using', in particular).
@@ -3,8 +3,6 @@
 
 #include "eventstats.h"
 
-#include "logging_categories_p.h"
-
 using namespace Quotient;
 
 EventStats EventStats::fromRange(const Room* room, const Room::rev_iter_t& from,
@@ -14,21 +12,15 @@ EventStats EventStats::fromRange(const Room* room, const Room::rev_iter_t& from,
     Q_ASSERT(to <= room->historyEdge());
     Q_ASSERT(from >= Room::rev_iter_t(room->syncEdge()));
     Q_ASSERT(from <= to);
-    QElapsedTimer et;
-    et.start();
-    const auto result =
-        accumulate(from, to, init,
-                   [room](EventStats acc, const TimelineItem& ti) {
-                       acc.notableCount += room->isEventNotable(ti);
-                       acc.highlightCount += room->notificationFor(ti).type
-                                             == Notification::Highlight;
-                       return acc;
-                   });
-    if (et.nsecsElapsed() > ProfilerMinNsecs / 10)
-        qCDebug(PROFILER).nospace()
-            << "Event statistics collection over index range [" << from->index()
-            << "," << (to - 1)->index() << "] took " << et;
-    return result;
+    if (from == to)
+        return init;
+    // Reverse iterators go from newer to older events; the room keeps running
+    // totals of notable and highlighted events, so this doesn't need to walk
+    // the range
+    const auto [notableCount, highlightCount] =
+        room->eventCounts((to - 1)->index(), from->index());
+    return { init.notableCount + notableCount, init.highlightCount + highlightCount,
+             init.isEstimate };
 }
 
 EventStats EventStats::fromMarker(const Room* room,
@@ -60,11 +52,9 @@ bool EventStats::updateOnMarkerMove(const Room* room, const marker_t& oldMarker,
     Q_ASSERT(isValidFor(room, oldMarker));
     Q_ASSERT(oldMarker > newMarker);
 
-    // A bit of optimisation: only calculate the difference if the marker moved
-    // less than half the remaining timeline ahead; otherwise, recalculation
-    // over the remaining timeline will very likely be faster.
-    if (oldMarker != room->historyEdge()
-        && oldMarker - newMarker < newMarker - marker_t(room->syncEdge())) {
+    // Collecting statistics over a range is cheap, so only the events between
+    // the markers are subtracted, unless the old marker is outside the timeline
+    if (oldMarker != room->historyEdge()) {
         const auto removedStats = fromRange(room, newMarker, oldMarker);
         Q_ASSERT(notableCount >= removedStats.notableCount
                  && highlightCount >= removedStats.highlightCount);
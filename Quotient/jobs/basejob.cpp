@@ -123,6 +123,8 @@ public:
 
     QByteArrayList expectedKeys;
 
+    bool readsReplyBody = true;
+
     // When the QNetworkAccessManager is destroyed it destroys all pending replies.
     // Using QPointer allows us to know when that happend.
     QPointer<QNetworkReply> reply;
@@ -274,6 +276,8 @@ void BaseJob::setExpectedKeys(const QByteArrayList& keys)
     d->expectedKeys = keys;
 }
 
+void BaseJob::setReadsReplyBody(bool readsBody) { d->readsReplyBody = readsBody; }
+
 const QNetworkReply* BaseJob::reply() const { return d->reply.data(); }
 
 QNetworkReply* BaseJob::reply() { return d->reply.data(); }
@@ -418,7 +422,7 @@ void BaseJob::gotReply()
 {
     // Defer actually updating the status until it's finalised
     auto statusSoFar = checkReply(reply());
-    if (statusSoFar.good()
+    if (statusSoFar.good() && d->readsReplyBody
         && d->expectedContentTypes == QByteArrayList { "application/json" }) //
     {
         d->rawResponse = reply()->readAll();
@@ -437,7 +441,8 @@ void BaseJob::gotReply()
         setStatus(statusSoFar);
         if (!status().good()) // Bad JSON in a "good" reply: bail out
             return;
-        // If the endpoint expects anything else than just (API-related) JSON
+        // If the endpoint expects anything else than just (API-related) JSON,
+        // or the job opted out with setReadsReplyBody(false),
         // reply()->readAll() is not performed and the whole reply processing
         // is left to derived job classes: they may read it piecemeal or customise
         // per content type in prepareResult(), or even have read it already
@@ -355,6 +355,14 @@ protected:
     QByteArrayList expectedKeys() const;
     void addExpectedKey(const QByteArray &key);
     void setExpectedKeys(const QByteArrayList &keys);
+    //! \brief Enable or disable reading the response body by BaseJob
+    //!
+    //! By default, BaseJob reads the whole body of a successful response and,
+    //! for `application/json` responses, parses it before prepareResult() is
+    //! invoked. Passing false leaves reading the body to the derived class,
+    //! e.g. to parse it on the fly from onSentRequest(). Error bodies are
+    //! always read by BaseJob, for prepareError().
+    void setReadsReplyBody(bool readsBody);
 
     const QNetworkReply* reply() const;
     QNetworkReply* reply();
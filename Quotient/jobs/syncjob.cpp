@@ -5,6 +5,8 @@
 
 #include "../logging_categories_p.h"
 
+#include <QtNetwork/QNetworkReply>
+
 using namespace Quotient;
 
 static size_t jobId = 0;
@@ -22,6 +24,8 @@ SyncJob::SyncJob(const QString& since, const QString& filter, int timeout,
         query.addQueryItem(QStringLiteral("timeout"), QString::number(timeout));
     addParam<IfNotEmpty>(query, QStringLiteral("since"), since);
     setRequestQuery(query);
+    // The reply body is split into rooms on the fly, see onSentRequest()
+    setReadsReplyBody(false);
 
     setMaxRetries(std::numeric_limits<int>::max());
 }
@@ -33,9 +37,23 @@ SyncJob::SyncJob(const QString& since, const Filter& filter, int timeout,
               timeout, presence)
 {}
 
+void SyncJob::onSentRequest(QNetworkReply* reply)
+{
+    parser.reset(); // In case of a retry
+    connect(reply, &QIODevice::readyRead, this, [this, reply] {
+        // Leave error bodies to BaseJob::prepareError()
+        if (!status().good()
+            || reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() / 100 != 2)
+            return;
+        parser.addData(reply->readAll());
+    });
+}
+
 BaseJob::Status SyncJob::prepareResult()
 {
-    d.parseJson(jsonData());
+    parser.addData(reply()->readAll()); // Whatever hasn't been consumed by now
+    if (!parser.finish(d))
+        return { IncorrectResponse, parser.errorString() };
     if (Q_LIKELY(d.unresolvedRooms().isEmpty()))
         return Success;
 
@@ -18,9 +18,11 @@ public:
     SyncData takeData() { return std::move(d); }
 
 protected:
+    void onSentRequest(QNetworkReply* reply) override;
     Status prepareResult() override;
 
 private:
     SyncData d;
+    SyncDataStreamParser parser;
 };
 } // namespace Quotient
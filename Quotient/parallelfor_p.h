@@ -0,0 +1,46 @@
+// SPDX-FileCopyrightText: 2026 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <QtCore/QSemaphore>
+#include <QtCore/QThreadPool>
+
+#include <algorithm>
+#include <atomic>
+
+namespace Quotient::_impl {
+
+//! \brief Call \p fn for each index in [0, \p count) using the global thread pool
+//!
+//! The calling thread takes part in processing as well, so this doesn't deadlock even if
+//! the pool has no free threads. The order in which indices are processed is not defined;
+//! \p fn should store its result by index if the order matters.
+//! \return the number of threads that have taken part in processing
+template <typename FnT>
+int parallelFor(size_t count, const FnT& fn)
+{
+    if (count == 0)
+        return 0;
+    std::atomic<size_t> nextIndex = 0;
+    const auto processIndices = [&nextIndex, count, &fn] {
+        for (auto i = nextIndex++; i < count; i = nextIndex++)
+            fn(i);
+    };
+    auto* const pool = QThreadPool::globalInstance();
+    const auto maxHelpers =
+        std::min(static_cast<size_t>(pool->maxThreadCount()), count) - 1;
+    QSemaphore helpersDone;
+    int helpers = 0;
+    for (; static_cast<size_t>(helpers) < maxHelpers; ++helpers)
+        if (!pool->tryStart([&processIndices, &helpersDone] {
+                processIndices();
+                helpersDone.release();
+            }))
+            break;
+    processIndices();
+    helpersDone.acquire(helpers);
+    return helpers + 1;
+}
+
+} // namespace Quotient::_impl
@@ -0,0 +1,309 @@
+// SPDX-FileCopyrightText: 2026 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "pushruleevaluator.h"
+
+#include "logging_categories_p.h"
+
+#include <QtCore/QJsonArray>
+#include <QtCore/QRegularExpression>
+
+#include <algorithm>
+
+using namespace Quotient;
+
+namespace {
+
+constexpr auto ContentBodyKey = "content.body"_ls;
+
+//! Split a dot-separated event field path, with `\.` and `\\` as escapes
+QStringList splitFieldPath(const QString& key)
+{
+    QStringList result { QString() };
+    for (auto it = key.cbegin(); it != key.cend(); ++it) {
+        if (*it == u'\\' && std::next(it) != key.cend()
+            && (*std::next(it) == u'.' || *std::next(it) == u'\\'))
+            result.back() += *++it;
+        else if (*it == u'.')
+            result.push_back({});
+        else
+            result.back() += *it;
+    }
+    return result;
+}
+
+QJsonValue fieldValue(const QJsonObject& eventJson, const QStringList& path)
+{
+    QJsonValue value = eventJson;
+    for (const auto& part : path) {
+        if (!value.isObject())
+            return {};
+        value = value.toObject().value(part);
+    }
+    return value;
+}
+
+bool hasWildcards(const QString& pattern)
+{
+    return pattern.contains(u'*') || pattern.contains(u'?');
+}
+
+//! \brief Make a case-insensitive matcher from a regular expression
+//! \param wordBoundaries whether the match should be at word boundaries
+//!        anywhere in the string, rather than on the whole string
+QRegularExpression makeMatcher(const QString& pattern, bool wordBoundaries)
+{
+    QRegularExpression regex(wordBoundaries
+                                 ? QString("(?:^|\\W)"_ls + pattern + "(?:\\W|$)"_ls)
+                                 : QRegularExpression::anchoredPattern(pattern),
+                             QRegularExpression::CaseInsensitiveOption
+                                 | QRegularExpression::UseUnicodePropertiesOption
+                                 | QRegularExpression::DotMatchesEverythingOption);
+    regex.optimize();
+    return regex;
+}
+
+QRegularExpression globToRegex(const QString& glob, bool wordBoundaries)
+{
+    QString pattern;
+    for (const auto c : glob)
+        if (c == u'*')
+            pattern += ".*"_ls;
+        else if (c == u'?')
+            pattern += u'.';
+        else
+            pattern += QRegularExpression::escape(QString(c));
+    return makeMatcher(pattern, wordBoundaries);
+}
+
+struct Condition {
+    enum Kind {
+        EventMatch,
+        EventPropertyIs,
+        EventPropertyContains,
+        ContainsDisplayName,
+        RoomMemberCount,
+        SenderNotificationPermission,
+        Unsupported
+    };
+    Kind kind = Unsupported;
+    QStringList path{};
+    //! The pattern for event_match, or the key for sender_notification_permission
+    QString pattern{};
+    //! Whether event_match looks for words in the body rather than matches the whole field
+    bool matchWords = false;
+    //! Whether the event_match pattern has no wildcards
+    bool isLiteral = false;
+    QRegularExpression regex{};
+    QJsonValue value{};
+    enum Comparison { Equal, Less, Greater, LessOrEqual, GreaterOrEqual };
+    Comparison comparison = Equal;
+    int memberCount = 0;
+};
+
+Condition eventMatch(const QString& key, const QString& pattern)
+{
+    const bool matchWords = key == ContentBodyKey;
+    const bool isLiteral = !hasWildcards(pattern);
+    return { .kind = Condition::EventMatch,
+             .path = splitFieldPath(key),
+             .pattern = pattern,
+             .matchWords = matchWords,
+             .isLiteral = isLiteral,
+             .regex = matchWords || !isLiteral ? globToRegex(pattern, matchWords)
+                                               : QRegularExpression() };
+}
+
+Condition compileCondition(const PushCondition& c)
+{
+    if (c.kind == "event_match"_ls)
+        return eventMatch(c.key, c.pattern);
+    if (c.kind == "event_property_is"_ls || c.kind == "event_property_contains"_ls)
+        return { .kind = c.kind == "event_property_is"_ls ? Condition::EventPropertyIs
+                                                          : Condition::EventPropertyContains,
+                 .path = splitFieldPath(c.key),
+                 .value = QJsonValue::fromVariant(c.value) };
+    if (c.kind == "contains_display_name"_ls)
+        return { .kind = Condition::ContainsDisplayName };
+    if (c.kind == "sender_notification_permission"_ls)
+        return { .kind = Condition::SenderNotificationPermission, .pattern = c.key };
+    if (c.kind == "room_member_count"_ls) {
+        static const QRegularExpression isRegex("^(==|<=|>=|<|>)?([0-9]+)$"_ls);
+        const auto match = isRegex.match(c.is);
+        if (!match.hasMatch()) {
+            qCWarning(MAIN) << "Invalid room_member_count condition:" << c.is;
+            return {};
+        }
+        const auto op = match.capturedView(1);
+        return { .kind = Condition::RoomMemberCount,
+                 .comparison = op == "<"_ls    ? Condition::Less
+                               : op == ">"_ls  ? Condition::Greater
+                               : op == "<="_ls ? Condition::LessOrEqual
+                               : op == ">="_ls ? Condition::GreaterOrEqual
+                                               : Condition::Equal,
+                 .memberCount = match.capturedView(2).toInt() };
+    }
+    return {};
+}
+
+PushActions compileActions(const QVector<QVariant>& actions)
+{
+    PushActions result;
+    for (const auto& action : actions) {
+        if (action.typeId() == QMetaType::QString) {
+            // "dont_notify" is the same as no action; "coalesce" is treated as "notify"
+            if (const auto name = action.toString(); name == "notify"_ls || name == "coalesce"_ls)
+                result.notify = true;
+            continue;
+        }
+        const auto tweak = action.toMap();
+        if (const auto tweakName = tweak.value("set_tweak"_ls).toString();
+            tweakName == "highlight"_ls)
+            result.highlight = tweak.value("value"_ls, true).toBool();
+        else if (tweakName == "sound"_ls)
+            result.sound = tweak.value("value"_ls).toString();
+    }
+    return result;
+}
+
+struct Rule {
+    std::vector<Condition> conditions;
+    PushActions actions;
+};
+
+} // namespace
+
+class PushRuleEvaluator::Private {
+public:
+    //! Override, content and underride rules, in the order of evaluation
+    std::vector<Rule> overrideRules;
+    std::vector<Rule> contentRules;
+    std::vector<Rule> underrideRules;
+    //! Room and sender rules, by their ids (room ids and user ids, respectively)
+    QHash<QString, PushActions> roomRules;
+    QHash<QString, PushActions> senderRules;
+    //! Matchers for `contains_display_name`, by display name
+    mutable QHash<QString, QRegularExpression> displayNameMatchers;
+
+    bool matches(const Condition& c, const RoomEvent& event, const RoomContext& context) const;
+    const PushActions* firstMatch(const std::vector<Rule>& rules, const RoomEvent& event,
+                                  const RoomContext& context) const;
+};
+
+bool PushRuleEvaluator::Private::matches(const Condition& c, const RoomEvent& event,
+                                         const RoomContext& context) const
+{
+    switch (c.kind) {
+    case Condition::EventMatch: {
+        const auto value = fieldValue(event.fullJson(), c.path);
+        if (!value.isString())
+            return false;
+        const auto str = value.toString();
+        if (c.isLiteral) {
+            if (!c.matchWords)
+                return str.compare(c.pattern, Qt::CaseInsensitive) == 0;
+            // Most bodies don't contain the pattern at all; skip the regex for them
+            if (!str.contains(c.pattern, Qt::CaseInsensitive))
+                return false;
+        }
+        return c.regex.match(str).hasMatch();
+    }
+    case Condition::EventPropertyIs:
+        return fieldValue(event.fullJson(), c.path) == c.value;
+    case Condition::EventPropertyContains:
+        return fieldValue(event.fullJson(), c.path).toArray().contains(c.value);
+    case Condition::ContainsDisplayName: {
+        const auto& displayName = context.userDisplayName;
+        if (displayName.isEmpty())
+            return false;
+        static const QStringList bodyPath { ContentKey, BodyKey };
+        const auto body = fieldValue(event.fullJson(), bodyPath).toString();
+        if (!body.contains(displayName, Qt::CaseInsensitive))
+            return false;
+        auto matcherIt = displayNameMatchers.constFind(displayName);
+        if (matcherIt == displayNameMatchers.cend()) {
+            if (displayNameMatchers.size() >= 1000) // Display names come and go
+                displayNameMatchers.clear();
+            matcherIt = displayNameMatchers.insert(
+                displayName, makeMatcher(QRegularExpression::escape(displayName), true));
+        }
+        return matcherIt->match(body).hasMatch();
+    }
+    case Condition::RoomMemberCount:
+        switch (c.comparison) {
+        case Condition::Less: return context.memberCount < c.memberCount;
+        case Condition::Greater: return context.memberCount > c.memberCount;
+        case Condition::LessOrEqual: return context.memberCount <= c.memberCount;
+        case Condition::GreaterOrEqual: return context.memberCount >= c.memberCount;
+        case Condition::Equal: return context.memberCount == c.memberCount;
+        }
+        return false;
+    case Condition::SenderNotificationPermission:
+        return context.senderHasPermission
+               && context.senderHasPermission(event.senderId(), c.pattern);
+    case Condition::Unsupported:
+        return false;
+    }
+    return false;
+}
+
+const PushActions* PushRuleEvaluator::Private::firstMatch(const std::vector<Rule>& rules,
+                                                          const RoomEvent& event,
+                                                          const RoomContext& context) const
+{
+    for (const auto& rule : rules)
+        if (std::ranges::all_of(rule.conditions, [this, &event, &context](const Condition& c) {
+                return matches(c, event, context);
+            }))
+            return &rule.actions;
+    return nullptr;
+}
+
+PushRuleEvaluator::PushRuleEvaluator(const PushRuleset& ruleset)
+    : d(makeImpl<Private>())
+{
+    const auto compileRules = [](const QVector<PushRule>& rules, std::vector<Rule>& target,
+                                 bool contentRules = false) {
+        for (const auto& rule : rules) {
+            if (!rule.enabled)
+                continue;
+            Rule compiled { {}, compileActions(rule.actions) };
+            if (contentRules)
+                compiled.conditions.push_back(eventMatch(ContentBodyKey, rule.pattern));
+            else
+                std::ranges::transform(rule.conditions, std::back_inserter(compiled.conditions),
+                                       compileCondition);
+            target.push_back(std::move(compiled));
+        }
+    };
+    compileRules(ruleset.override, d->overrideRules);
+    compileRules(ruleset.content, d->contentRules, true);
+    compileRules(ruleset.underride, d->underrideRules);
+    // A room or a sender can only have one rule, as rule ids are unique
+    for (const auto& rule : ruleset.room)
+        if (rule.enabled)
+            d->roomRules.insert(rule.ruleId, compileActions(rule.actions));
+    for (const auto& rule : ruleset.sender)
+        if (rule.enabled)
+            d->senderRules.insert(rule.ruleId, compileActions(rule.actions));
+}
+
+PushRuleEvaluator PushRuleEvaluator::fromAccountData(const QJsonObject& pushRulesContent)
+{
+    return PushRuleEvaluator(fromJson<PushRuleset>(pushRulesContent.value("global"_ls)));
+}
+
+PushActions PushRuleEvaluator::evaluate(const RoomEvent& event, const RoomContext& context) const
+{
+    if (const auto* actions = d->firstMatch(d->overrideRules, event, context))
+        return *actions;
+    if (const auto* actions = d->firstMatch(d->contentRules, event, context))
+        return *actions;
+    if (const auto it = d->roomRules.constFind(context.roomId); it != d->roomRules.cend())
+        return *it;
+    if (const auto it = d->senderRules.constFind(event.senderId()); it != d->senderRules.cend())
+        return *it;
+    if (const auto* actions = d->firstMatch(d->underrideRules, event, context))
+        return *actions;
+    return {};
+}
@@ -0,0 +1,67 @@
+// SPDX-FileCopyrightText: 2026 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "csapi/definitions/push_ruleset.h"
+#include "events/roomevent.h"
+
+#include <functional>
+
+namespace Quotient {
+
+constexpr inline auto PushRulesEventType = "m.push_rules"_ls;
+
+//! What push rules say to do about an event
+struct QUOTIENT_API PushActions {
+    bool notify = false;
+    bool highlight = false;
+    //! The sound to play, if the rule sets the `sound` tweak
+    QString sound{};
+};
+
+//! \brief Push rules prepared for evaluation against events
+//!
+//! This evaluates push rules (see the `m.push_rules` account data) locally,
+//! following the "Push rules" section of the Client-Server API. Everything
+//! that doesn't depend on the event is done once, when the ruleset is
+//! compiled: glob patterns become regular expressions (or plain string
+//! comparisons if they have no wildcards), event field paths are split,
+//! `room_member_count` conditions are parsed and actions are turned into
+//! PushActions. Room and sender rules are looked up by id, rather than
+//! checked one by one.
+//!
+//! Unknown and unsupported condition kinds never match, as the specification
+//! requires.
+class QUOTIENT_API PushRuleEvaluator {
+public:
+    //! The data about the room needed to evaluate push rules
+    struct RoomContext {
+        QString roomId;
+        //! The id of the user to evaluate push rules for
+        QString userId;
+        //! The display name of that user in the room; empty if not set
+        QString userDisplayName;
+        int memberCount = 0;
+        //! \brief Whether the sender can trigger notifications of the given kind
+        //!
+        //! This is used for `sender_notification_permission` conditions, with
+        //! the event sender id and the condition key; these conditions don't
+        //! match if this is empty.
+        std::function<bool(const QString&, const QString&)> senderHasPermission{};
+    };
+
+    explicit PushRuleEvaluator(const PushRuleset& ruleset = {});
+
+    //! Compile the push rules from the content of `m.push_rules` account data
+    static PushRuleEvaluator fromAccountData(const QJsonObject& pushRulesContent);
+
+    //! Find the first rule matching the event and return its actions
+    PushActions evaluate(const RoomEvent& event, const RoomContext& context) const;
+
+private:
+    class Private;
+    ImplPtr<Private> d;
+};
+
+} // namespace Quotient
@@ -13,9 +13,12 @@
 #include "connection.h"
 #include "converters.h"
 #include "database.h"
+#include "eventcounters_p.h"
 #include "eventstats.h"
 #include "keyverificationsession.h"
 #include "logging_categories_p.h"
+#include "parallelfor_p.h"
+#include "pushruleevaluator.h"
 #include "qt_connection_util.h"
 #include "quotient_common.h"
 #include "ranges_extras.h"
@@ -72,6 +75,8 @@
 #include <array>
 #include <cmath>
 #include <functional>
+#include <map>
+#include <unordered_set>
 
 using namespace Quotient;
 using namespace std::placeholders;
@@ -79,6 +84,16 @@ using std::llround;
 
 enum EventsPlacement : int { Older = -1, Newer = 1 };
 
+// Beyond this number of state events changed between two saves to the cache,
+// rewriting the cache entirely is cheaper than keeping track of the changes
+constexpr size_t MaxUnsavedStateKeys = 1000;
+
+// The number of inbound megolm sessions a room keeps unpickled in memory
+constexpr size_t MaxCachedGroupSessions = 100;
+
+// Below this number of encrypted events in a batch it's not worth going parallel
+constexpr size_t MinEventsForParallelDecryption = 16;
+
 class Q_DECL_HIDDEN Room::Private {
 public:
     Private(Connection* c, QString id_, JoinState initialJoinState)
@@ -116,6 +131,8 @@ public:
     // Starting up with estimate event statistics as there's zero knowledge
     // about the timeline.
     EventStats partiallyReadStats {}, unreadStats {};
+    //! Running totals of notable and highlighted events, to get EventStats quickly
+    _impl::EventCounters eventCounters;
 
     // For storing a list of current member names for the purpose of disambiguation.
     QMultiHash<QString, QString> memberNameMap;
@@ -123,7 +140,10 @@ public:
     QStringList membersLeft;
     QStringList membersTyping;
 
-    QHash<QString, QSet<QString>> eventIdReadUsers;
+    //! Users whose read receipts point to events in the timeline, by timeline index
+    QHash<TimelineItem::index_t, QSet<QString>> readUsersAtIndex;
+    //! Users whose read receipts point to events not loaded to the timeline
+    QHash<QString, QSet<QString>> readUsersAtUnloadedEvent;
     bool displayed = false;
     QString firstDisplayedEventId;
     QString lastDisplayedEventId;
@@ -131,6 +151,18 @@ public:
     QString fullyReadUntilEventId;
     TagsMap tags;
     std::unordered_map<QString, EventPtr> accountData;
+    //! State events changed since the last save to the cache
+    std::unordered_set<StateEventKey> unsavedStateKeys;
+    //! Account data types changed since the last save to the cache
+    QSet<QString> unsavedAccountDataTypes;
+    //! Whether the next save to the cache should rewrite it entirely
+    bool needsFullCacheWrite = true;
+    //! \brief The cache file with the room state not loaded yet
+    //!
+    //! Non-empty only when the room has been loaded from the cache index
+    //! (see Connection::setLazyCacheLoading()) and nothing has needed the full
+    //! room state since then.
+    QString pendingCacheFileName;
     //! \brief Previous (i.e. next towards the room beginning) batch token
     //!
     //! "Emptiness" of this can have two forms. If prevBatch.has_value() it means the library
@@ -139,6 +171,13 @@ public:
     //! that the server previously reported that all events have been loaded and there's no point in
     //! requesting further historical batches.
     std::optional<QString> prevBatch = QString();
+    //! \brief Tokens to load history preceding events in the timeline
+    //!
+    //! Each token is stored at the timeline index of the oldest event in
+    //! a batch that came from /sync or /messages; unloadOldEvents() uses these
+    //! to set prevBatch so that unloaded events can be loaded again. Tokens are
+    //! only recorded while Connection::maxResidentRoomEvents() is not negative.
+    std::map<TimelineItem::index_t, QString> historyTokens;
     int lastRequestedHistorySize = 0;
     JobHandle<GetRoomEventsJob> eventsHistoryJob;
     JobHandle<GetMembersByRoomJob> allMembersJob;
@@ -215,6 +254,8 @@ public:
     Timeline::const_iterator syncEdge() const { return timeline.cend(); }
 
     JobHandle<GetRoomEventsJob> getPreviousContent(int limit = 10, const QString &filter = {});
+    //! Unload the oldest events beyond Connection::maxResidentRoomEvents()
+    void unloadOldEvents();
 
     Changes updateStateFrom(StateEvents&& events)
     {
@@ -222,11 +263,14 @@ public:
         if (!events.empty()) {
             QElapsedTimer et;
             et.start();
+            const auto compactEvents = connection->compactEventStorage();
             for (auto&& eptr : std::move(events)) {
                 const auto& evt = *eptr;
                 Q_ASSERT(evt.isStateEvent());
                 if (auto change = q->processStateEvent(evt); change) {
                     changes |= change;
+                    if (compactEvents)
+                        evt.compactJson(&connection->stringPool());
                     baseState[{ evt.matrixType(), evt.stateKey() }] =
                         std::move(eptr);
                 }
@@ -264,11 +308,35 @@ public:
     Timeline::size_type moveEventsToTimeline(RoomEventsRange events,
                                              EventsPlacement placement);
 
+    //! The push rule context set up once for the batch of events being added
+    std::optional<PushRuleEvaluator::RoomContext> batchPushRuleContext;
+    PushRuleEvaluator::RoomContext pushRuleContext() const;
+    //! \brief Re-evaluate notifications for the timeline item after its event has been replaced
+    //!
+    //! The notification for the item gets updated (e.g., a mention in a newly decrypted
+    //! event becomes a highlight, a redacted event stops being one), and so do eventCounters.
+    void updateEventCounters(const TimelineItem& ti)
+    {
+        const auto n = q->checkForNotifications(ti);
+        if (n.type != Notification::None)
+            notifications.insert(ti->id(), n);
+        else
+            notifications.remove(ti->id());
+        eventCounters.update(ti.index(), q->isEventNotable(ti), n.type == Notification::Highlight);
+    }
+
     /**
      * Remove events from the passed container that are already in the timeline
      */
     void dropExtraneousEvents(RoomEvents& events) const;
     void decryptIncomingEvents(RoomEvents& events);
+    //! \brief Decrypt megolm events, on several threads if there are many
+    //!
+    //! This also does the replay checks and saves their records.
+    //! \return the decrypted events in the order of \p encryptedEvents;
+    //!         nullptr for those that could not be decrypted
+    std::vector<RoomEventPtr> decryptEvents(
+        const std::vector<const EncryptedEvent*>& encryptedEvents);
 
     //! \brief update last receipt record for a given user
     //!
@@ -276,6 +344,22 @@ public:
     //!         it, or `std::nullopt` if no change took place
     std::optional<QString> setLastReadReceipt(const QString& userId, rev_iter_t newMarker,
                                               ReadReceipt newReceipt = {});
+    //! \brief update last receipt record for a given user
+    //!
+    //! This is the same as the overload above, with the event position given
+    //! as a timeline index, or `std::nullopt` if it should be looked up by
+    //! the event id in \p newReceipt.
+    std::optional<QString> setLastReadReceipt(const QString& userId,
+                                              std::optional<TimelineItem::index_t> newIndex,
+                                              ReadReceipt newReceipt);
+    //! \brief Apply all read receipts from the content of an m.receipt event
+    //!
+    //! Event ids are resolved to timeline positions once per event, rather
+    //! than once per receipt.
+    //! \param updatedUserIds ids of users other than the local one whose
+    //!        read receipts have moved get appended to this
+    Changes applyReadReceipts(const QJsonObject& receiptsJson,
+                              QVector<QString>& updatedUserIds);
     Changes setLocalLastReadReceipt(const rev_iter_t& newMarker,
                                     ReadReceipt newReceipt = {},
                                     bool deferStatsUpdate = false);
@@ -328,17 +412,80 @@ public:
     void setTags(TagsMap&& newTags);
 
     QJsonObject toJson() const;
+    QJsonObject stateEventToCacheJson(const StateEvent& evt) const;
+    void addCountersToJson(QJsonObject& json) const;
+    std::optional<QJsonObject> takeCacheDelta();
+    QJsonObject toCacheIndexJson() const;
+    void loadPendingCachedState();
 
     bool isLocalMember(const QString& memberId) const { return memberId == connection->userId(); }
 
+    //! \brief Inbound megolm sessions used recently
+    //!
+    //! Sessions are unpickled from the database on first use and the least
+    //! recently used ones are dropped by evictGroupSessions(); the ids of all
+    //! sessions that are stored are in knownGroupSessionIds.
     std::unordered_map<QByteArray, QOlmInboundGroupSession> groupSessions;
+    std::unordered_map<QByteArray, quint64> groupSessionLastUse;
+    quint64 groupSessionUseCounter = 0;
+    QSet<QByteArray> knownGroupSessionIds;
     std::optional<QOlmOutboundGroupSession> currentOutboundMegolmSession = {};
+    //! Megolm message index records for replay detection, by session id;
+    //! records are dropped along with their sessions in evictGroupSessions()
+    std::unordered_map<QString, std::unordered_map<uint32_t, std::pair<QString, qint64>>>
+        messageIndexRecords;
+    QVector<std::tuple<QString, uint32_t, QString, qint64>> unsavedMessageIndexRecords;
+
+    //! \brief Get the inbound megolm session, loading it from the database if needed
+    //! \return the session; nullptr if there's no session with this id
+    QOlmInboundGroupSession* groupSession(const QByteArray& sessionId)
+    {
+        auto it = groupSessions.find(sessionId);
+        if (it == groupSessions.end()) {
+            if (!knownGroupSessionIds.contains(sessionId))
+                return nullptr;
+            auto&& session = connection->database()->loadMegolmSession(id, sessionId);
+            if (!session) {
+                knownGroupSessionIds.remove(sessionId);
+                return nullptr;
+            }
+            it = groupSessions.try_emplace(sessionId, std::move(*session)).first;
+        }
+        groupSessionLastUse[sessionId] = ++groupSessionUseCounter;
+        return &it->second;
+    }
+
+    //! \brief Drop the least recently used sessions from groupSessions beyond the limit
+    //!
+    //! Message index records of the dropped sessions are dropped as well;
+    //! checkMessageIndex() loads them from the database again when needed.
+    void evictGroupSessions()
+    {
+        if (groupSessions.size() <= MaxCachedGroupSessions)
+            return;
+        saveMessageIndexRecords(); // Make sure nothing is lost with the dropped records
+        while (groupSessions.size() > MaxCachedGroupSessions) {
+            const auto lruIt = std::ranges::min_element(groupSessionLastUse, {},
+                                                        [](const auto& p) { return p.second; });
+            groupSessions.erase(lruIt->first);
+            messageIndexRecords.erase(QString::fromLatin1(lruIt->first));
+            groupSessionLastUse.erase(lruIt);
+        }
+    }
+
+    void cacheGroupSession(const QByteArray& sessionId, QOlmInboundGroupSession&& session)
+    {
+        groupSessions.insert_or_assign(sessionId, std::move(session));
+        groupSessionLastUse[sessionId] = ++groupSessionUseCounter;
+        knownGroupSessionIds.insert(sessionId);
+        evictGroupSessions();
+    }
 
     bool addInboundGroupSession(QByteArray sessionId, QByteArray sessionKey,
                                 const QString& senderId,
                                 const QByteArray& olmSessionId, const QByteArray& senderKey, const QByteArray& senderEdKey)
     {
-        if (groupSessions.contains(sessionId)) {
+        if (knownGroupSessionIds.contains(sessionId)) {
             qCWarning(E2EE) << "Inbound Megolm session" << sessionId << "already exists";
             return false;
         }
@@ -354,17 +501,28 @@ public:
         megolmSession.setOlmSessionId(olmSessionId);
         qCWarning(E2EE) << "Adding inbound session" << sessionId;
         connection->saveMegolmSession(q, megolmSession, senderKey, senderEdKey);
-        groupSessions.try_emplace(sessionId, std::move(megolmSession));
+        cacheGroupSession(sessionId, std::move(megolmSession));
         return true;
     }
 
-    QString groupSessionDecryptMessage(const QByteArray& ciphertext,
-                                       const QByteArray& sessionId,
-                                       const QString& eventId,
-                                       const QDateTime& timestamp,
-                                       const QString& senderId)
+    //! Add the megolm session from the event; false if it's not added
+    bool addRoomKey(const RoomKeyEvent& roomKeyEvent, const QString& senderId,
+                    const QByteArray& olmSessionId, const QByteArray& senderKey,
+                    const QByteArray& senderEdKey);
+    //! Try to decrypt the timeline events waiting for any of the sessions again
+    void retryDecryption(const QStringList& sessionIds);
+
+    //! \brief Decrypt the event with its megolm session, without replay checks
+    //!
+    //! This only uses the group session of the event and doesn't touch
+    //! the database, so it can be called from any thread as long as no other
+    //! thread uses the same group session and groupSessions is not changed.
+    //! The session should be loaded with groupSession() beforehand.
+    //! Use checkMessageIndex() on the result to detect replays.
+    std::optional<std::pair<QString, uint32_t>> groupSessionDecrypt(
+        const EncryptedEvent& encryptedEvent)
     {
-        auto groupSessionIt = groupSessions.find(sessionId);
+        auto groupSessionIt = groupSessions.find(encryptedEvent.sessionId().toLatin1());
         if (groupSessionIt == groupSessions.end()) {
             // qCWarning(E2EE) << "Unable to decrypt event" << eventId
             //               << "The sender's device has not sent us the keys for "
@@ -373,32 +531,74 @@ public:
             return {};
         }
         auto& senderSession = groupSessionIt->second;
-        if (senderSession.senderId() != "BACKUP"_ls && senderSession.senderId() != senderId) {
+        if (senderSession.senderId() != "BACKUP"_ls
+            && senderSession.senderId() != encryptedEvent.senderId()) {
             qCWarning(E2EE) << "Sender from event does not match sender from session";
             return {};
         }
-        auto decryptResult = senderSession.decrypt(ciphertext);
+        auto decryptResult = senderSession.decrypt(encryptedEvent.ciphertext());
         if(!decryptResult) {
-            qCWarning(E2EE) << "Unable to decrypt event" << eventId
+            qCWarning(E2EE) << "Unable to decrypt event" << encryptedEvent.id()
             << "with matching megolm session:" << decryptResult.error();
             return {};
         }
         const auto& [content, index] = *decryptResult;
-        const auto& [recordEventId, ts] =
-            q->connection()->database()->groupSessionIndexRecord(
-                q->id(), QString::fromLatin1(senderSession.sessionId()), index);
-        if (recordEventId.isEmpty()) {
-            q->connection()->database()->addGroupSessionIndexRecord(
-                q->id(), QString::fromLatin1(senderSession.sessionId()), index, eventId,
-                timestamp.toMSecsSinceEpoch());
-        } else {
-            if ((eventId != recordEventId)
-                || (ts != timestamp.toMSecsSinceEpoch())) {
-                qCWarning(E2EE) << "Detected a replay attack on event" << eventId;
-                return {};
-            }
+        return std::pair { QString::fromUtf8(content), index };
+    }
+
+    //! \brief Check the message index of a decrypted event against replays
+    //!
+    //! This records the event as the one for this \p index of the session,
+    //! unless there's already a record for it, in which case the event has to
+    //! match the recorded one. Records are looked up in messageIndexRecords,
+    //! loading all records of the session from the database the first time;
+    //! new records are only stored in the database by saveMessageIndexRecords().
+    //! \return true if the event is fine; false if it's a replay attack
+    bool checkMessageIndex(const EncryptedEvent& encryptedEvent, uint32_t index)
+    {
+        const auto sessionId = encryptedEvent.sessionId();
+        auto sessionRecordsIt = messageIndexRecords.find(sessionId);
+        if (sessionRecordsIt == messageIndexRecords.end())
+            sessionRecordsIt = messageIndexRecords
+                                   .try_emplace(sessionId,
+                                                connection->database()->groupSessionIndexRecords(
+                                                    id, sessionId))
+                                   .first;
+
+        const auto eventId = encryptedEvent.id();
+        const auto timestamp = encryptedEvent.originTimestamp().toMSecsSinceEpoch();
+        const auto& [recordIt, inserted] =
+            sessionRecordsIt->second.try_emplace(index, eventId, timestamp);
+        if (inserted) {
+            unsavedMessageIndexRecords.push_back({ sessionId, index, eventId, timestamp });
+            return true;
+        }
+        const auto& [recordEventId, ts] = recordIt->second;
+        if ((eventId != recordEventId) || (ts != timestamp)) {
+            qCWarning(E2EE) << "Detected a replay attack on event" << eventId;
+            return false;
         }
-        return QString::fromUtf8(content);
+        return true;
+    }
+
+    //! Store records added by checkMessageIndex() in the database, in one transaction
+    void saveMessageIndexRecords()
+    {
+        if (unsavedMessageIndexRecords.isEmpty())
+            return;
+        connection->database()->addGroupSessionIndexRecords(id, unsavedMessageIndexRecords);
+        unsavedMessageIndexRecords.clear();
+    }
+
+    //! Make the decrypted event, checking that it belongs to this room
+    RoomEventPtr makeDecrypted(const EncryptedEvent& encryptedEvent, const QString& plaintext)
+    {
+        auto decryptedEvent = encryptedEvent.createDecrypted(plaintext);
+        if (decryptedEvent->roomId() == id)
+            return decryptedEvent;
+        qWarning(E2EE) << "Decrypted event" << encryptedEvent.id()
+                       << "not for this room; discarding";
+        return {};
     }
 
     bool shouldRotateMegolmSession() const
@@ -470,7 +670,7 @@ Room::Room(Connection* connection, QString id, JoinState initialJoinState)
                 connection->encryptionUpdate(this, d->membersInvited);
             }
         });
-        d->groupSessions = connection->loadRoomMegolmSessions(this);
+        d->knownGroupSessionIds = connection->database()->megolmSessionIds(id);
         d->currentOutboundMegolmSession =
             connection->database()->loadCurrentOutboundMegolmSession(id);
         if (d->currentOutboundMegolmSession
@@ -498,7 +698,7 @@ const QString& Room::id() const { return d->id; }
 
 QString Room::version() const
 {
-    const auto v = currentState().query(&RoomCreateEvent::version);
+    const auto v = d->currentState.query(&RoomCreateEvent::version);
     return v && !v->isEmpty() ? *v : QStringLiteral("1");
 }
 
@@ -510,7 +710,7 @@ bool Room::isUnstable() const
 
 QString Room::predecessorId() const
 {
-    if (const auto* evt = currentState().get<RoomCreateEvent>())
+    if (const auto* evt = d->currentState.get<RoomCreateEvent>())
         return evt->predecessor().roomId;
 
     return {};
@@ -528,8 +728,7 @@ Room* Room::predecessor(JoinStates statesFilter) const
 
 QString Room::successorId() const
 {
-    return currentState().queryOr(&RoomTombstoneEvent::successorRoomId,
-                                  QString());
+    return d->currentState.queryOr(&RoomTombstoneEvent::successorRoomId, QString());
 }
 
 Room* Room::successor(JoinStates statesFilter) const
@@ -561,12 +760,12 @@ bool Room::allHistoryLoaded() const
 
 QString Room::name() const
 {
-    return currentState().content<RoomNameEvent>().value;
+    return d->currentState.content<RoomNameEvent>().value;
 }
 
 QStringList Room::aliases() const
 {
-    if (const auto* evt = currentState().get<RoomCanonicalAliasEvent>()) {
+    if (const auto* evt = d->currentState.get<RoomCanonicalAliasEvent>()) {
         auto result = evt->altAliases();
         if (!evt->alias().isEmpty())
             result << evt->alias();
@@ -577,12 +776,12 @@ QStringList Room::aliases() const
 
 QStringList Room::altAliases() const
 {
-    return currentState().content<RoomCanonicalAliasEvent>().altAliases;
+    return d->currentState.content<RoomCanonicalAliasEvent>().altAliases;
 }
 
 QString Room::canonicalAlias() const
 {
-    return currentState().content<RoomCanonicalAliasEvent>().canonicalAlias;
+    return d->currentState.content<RoomCanonicalAliasEvent>().canonicalAlias;
 }
 
 QString Room::displayName() const { return d->displayname; }
@@ -610,7 +809,7 @@ void Room::refreshDisplayName() { d->updateDisplayname(); }
 
 QString Room::topic() const
 {
-    return currentState().content<RoomTopicEvent>().value;
+    return d->currentState.content<RoomTopicEvent>().value;
 }
 
 QString Room::avatarMediaId() const { return d->avatar.mediaId(); }
@@ -744,6 +943,7 @@ void Room::setJoinState(JoinState state)
     if (state == oldState)
         return;
     d->joinState = state;
+    d->needsFullCacheWrite = true; // Different join states are cached under different keys
     qCDebug(STATE) << "Room" << id() << "changed state: " << terse << oldState
                    << "->" << state;
     emit joinStateChanged(oldState, state);
@@ -752,61 +952,79 @@ void Room::setJoinState(JoinState state)
 std::optional<QString> Room::Private::setLastReadReceipt(const QString& userId, rev_iter_t newMarker,
                                                          ReadReceipt newReceipt)
 {
-    if (newMarker == historyEdge() && !newReceipt.eventId.isEmpty())
-        newMarker = q->findInTimeline(newReceipt.eventId);
-    if (newMarker != historyEdge()) {
+    return setLastReadReceipt(userId,
+                              newMarker != historyEdge()
+                                  ? std::optional(newMarker->index())
+                                  : std::nullopt,
+                              std::move(newReceipt));
+}
+
+std::optional<QString> Room::Private::setLastReadReceipt(
+    const QString& userId, std::optional<TimelineItem::index_t> newIndex,
+    ReadReceipt newReceipt)
+{
+    if (!newIndex && !newReceipt.eventId.isEmpty())
+        if (const auto pIdx = eventsIndex.constFind(newReceipt.eventId);
+            pIdx != eventsIndex.cend())
+            newIndex = *pIdx;
+    if (newIndex) {
+        Q_ASSERT(q->isValidIndex(*newIndex));
         // Try to auto-promote the read marker over the user's own messages
-        // (switch to direct iterators for that).
-        const auto eagerMarker =
-            find_if(newMarker.base(), syncEdge(),
-                    [userId](const TimelineItem& ti) { return ti->senderId() != userId; });
-        // eagerMarker is now just after the desired event for newMarker
-        if (eagerMarker != newMarker.base()) {
-            newMarker = rev_iter_t(eagerMarker);
+        auto index = *newIndex;
+        while (timeline.containsIndex(index + 1) && timeline.at(index + 1)->senderId() == userId)
+            ++index;
+        if (index != *newIndex)
             qDebug(EPHEMERAL) << "Auto-promoted read receipt for" << userId
-                               << "to" << *newMarker;
-        }
-        // Fill newReceipt with the event (and, if needed, timestamp) from
-        // eagerMarker
-        newReceipt.eventId = (eagerMarker - 1)->event()->id();
+                               << "to" << timeline.at(index);
+        newIndex = index;
+        newReceipt.eventId = timeline.at(index)->id();
         if (newReceipt.timestamp.isNull())
             newReceipt.timestamp = QDateTime::currentDateTime();
     }
+    auto& stringPool = connection->stringPool();
+    const auto internedUserId = stringPool.intern(userId);
     auto& storedReceipt =
-            lastReadReceipts[userId]; // clazy:exclude=detaching-member
+            lastReadReceipts[internedUserId]; // clazy:exclude=detaching-member
     const auto prevEventId = storedReceipt.eventId;
-    // Check that either the new marker is actually "newer" than the current one
-    // or, if both markers are at historyEdge(), event ids are different.
+    if (prevEventId == newReceipt.eventId)
+        return {};
+    const auto pPrevIdx = eventsIndex.constFind(prevEventId);
+    // Check that the new marker is actually "newer" than the current one.
     // This logic tackles, in particular, the case when the new event is not
     // found (most likely, because it's too old and hasn't been fetched from
     // the server yet) but there is a previous marker for a user; in that case,
     // the previous marker is kept because read receipts are not supposed
     // to move backwards. If neither new nor old event is found, the new receipt
     // is blindly stored, in a hope it's also "newer" in the timeline.
-    // NB: with reverse iterators, timeline history edge >= sync edge
-    if (prevEventId == newReceipt.eventId
-        || newMarker > q->findInTimeline(prevEventId))
+    if (pPrevIdx != eventsIndex.cend() && (!newIndex || *newIndex < *pPrevIdx))
         return {};
 
     // Finally make the change
 
-    auto oldEventReadUsersIt =
-        eventIdReadUsers.find(prevEventId); // clazy:exclude=detaching-member
-    if (oldEventReadUsersIt != eventIdReadUsers.end()) {
-        oldEventReadUsersIt->remove(userId);
-        if (oldEventReadUsersIt->isEmpty())
-            eventIdReadUsers.erase(oldEventReadUsersIt);
-    }
-    eventIdReadUsers[newReceipt.eventId].insert(userId);
+    const auto removeReadUser = [&userId](auto& readUsers, const auto& key) {
+        if (auto it = readUsers.find(key); it != readUsers.end()) {
+            it->remove(userId);
+            if (it->isEmpty())
+                readUsers.erase(it);
+        }
+    };
+    if (pPrevIdx != eventsIndex.cend())
+        removeReadUser(readUsersAtIndex, *pPrevIdx);
+    else
+        removeReadUser(readUsersAtUnloadedEvent, prevEventId);
+    if (newIndex)
+        readUsersAtIndex[*newIndex].insert(internedUserId);
+    else
+        readUsersAtUnloadedEvent[newReceipt.eventId].insert(internedUserId);
     storedReceipt = std::move(newReceipt);
 
     {
         auto dbg = qDebug(EPHEMERAL); // NB: qCDebug can't be used like that
         dbg << "The new read receipt for" << userId << "is now at";
-        if (newMarker == historyEdge())
-            dbg << storedReceipt.eventId;
+        if (newIndex)
+            dbg << timeline.at(*newIndex);
         else
-            dbg << *newMarker;
+            dbg << storedReceipt.eventId;
     }
 
     // NB: This method, unlike setLocalLastReadReceipt, doesn't emit
@@ -816,6 +1034,41 @@ std::optional<QString> Room::Private::setLastReadReceipt(const QString& userId,
     return prevEventId;
 }
 
+Room::Changes Room::Private::applyReadReceipts(const QJsonObject& receiptsJson,
+                                               QVector<QString>& updatedUserIds)
+{
+    Changes changes = Change::None;
+    const auto& localUserId = connection->userId();
+    for (auto eventIt = receiptsJson.begin(); eventIt != receiptsJson.end(); ++eventIt) {
+        const auto reads = eventIt.value().toObject().value("m.read"_ls).toObject();
+        if (reads.isEmpty())
+            continue;
+        const auto evtId = eventIt.key();
+        std::optional<TimelineItem::index_t> index;
+        if (const auto pIdx = eventsIndex.constFind(evtId); pIdx != eventsIndex.cend())
+            index = *pIdx;
+        else
+            qDebug(EPHEMERAL) << "Event" << evtId
+                              << "is not found; saving read receipt(s) anyway";
+        for (auto userIt = reads.begin(); userIt != reads.end(); ++userIt) {
+            ReadReceipt rr{ evtId, fromJson<QDateTime>(userIt->toObject().value("ts"_ls)) };
+            const auto userId = userIt.key();
+            if (userId == localUserId) {
+                // Local user is special, and will get a signal about its read
+                // receipt separately from (and before) a signal on everybody
+                // else. No particular reason, just less cumbersome code.
+                changes |= setLocalLastReadReceipt(index ? q->findInTimeline(*index)
+                                                         : historyEdge(),
+                                                   std::move(rr));
+            } else if (setLastReadReceipt(userId, index, std::move(rr))) {
+                changes |= Change::Other;
+                updatedUserIds.push_back(userId);
+            }
+        }
+    }
+    return changes;
+}
+
 Room::Changes Room::Private::setLocalLastReadReceipt(const rev_iter_t& newMarker,
                                                      ReadReceipt newReceipt,
                                                      bool deferStatsUpdate)
@@ -1044,9 +1297,41 @@ Notification Room::notificationFor(const TimelineItem &ti) const
     return d->notifications.value(ti->id());
 }
 
+std::pair<qsizetype, qsizetype> Room::eventCounts(TimelineItem::index_t first,
+                                                  TimelineItem::index_t last) const
+{
+    Q_ASSERT(first > last || (isValidIndex(first) && isValidIndex(last)));
+    const auto counts = d->eventCounters.inRange(first, last);
+    return { counts.notable, counts.highlight };
+}
+
 Notification Room::checkForNotifications(const TimelineItem &ti)
 {
-    return { Notification::None };
+    if (ti->senderId() == connection()->userId() || ti->isRedacted())
+        return { Notification::None };
+    std::optional<PushRuleEvaluator::RoomContext> context;
+    const auto actions = connection()->pushRuleEvaluator().evaluate(
+        *ti, d->batchPushRuleContext ? *d->batchPushRuleContext
+                                     : context.emplace(d->pushRuleContext()));
+    if (!actions.notify)
+        return { Notification::None };
+    return { actions.highlight ? Notification::Highlight : Notification::Basic };
+}
+
+PushRuleEvaluator::RoomContext Room::Private::pushRuleContext() const
+{
+    return { id, connection->userId(), q->localMember().name(), q->joinedCount(),
+             [this](const QString& senderId, const QString& key) {
+                 const auto* plEvent = currentState.get<RoomPowerLevelsEvent>();
+                 if (!plEvent)
+                     return false;
+                 const auto requiredLevel =
+                     key == "room"_ls ? plEvent->roomNotification()
+                                      : plEvent->contentPart<QJsonObject>("notifications"_ls)
+                                            .value(key)
+                                            .toInt(50);
+                 return plEvent->powerLevelForUser(senderId) >= requiredLevel;
+             } };
 }
 
 int countFromStats(const EventStats& s)
@@ -1118,16 +1403,17 @@ const Room::RelatedEvents Room::relatedEvents(
 
 const RoomCreateEvent* Room::creation() const
 {
-    return currentState().get<RoomCreateEvent>();
+    return d->currentState.get<RoomCreateEvent>();
 }
 
 const RoomTombstoneEvent* Room::tombstone() const
 {
-    return currentState().get<RoomTombstoneEvent>();
+    return d->currentState.get<RoomTombstoneEvent>();
 }
 
 void Room::Private::getAllMembers()
 {
+    loadPendingCachedState(); // The members may well be in the cache
     // If already loaded or already loading, there's nothing to do here.
     if (q->joinedCount() <= currentState.eventsOfType(RoomMemberEvent::TypeId).size() || isJobPending(allMembersJob))
         return;
@@ -1242,7 +1528,9 @@ Room::rev_iter_t Room::fullyReadMarker() const
 
 QSet<QString> Room::userIdsAtEvent(const QString& eventId) const
 {
-    return d->eventIdReadUsers.value(eventId);
+    if (const auto pIdx = d->eventsIndex.constFind(eventId); pIdx != d->eventsIndex.cend())
+        return d->readUsersAtIndex.value(*pIdx);
+    return d->readUsersAtUnloadedEvent.value(eventId);
 }
 
 qsizetype Room::notificationCount() const
@@ -1512,13 +1800,13 @@ int Room::timelineSize() const { return int(d->timeline.size()); }
 
 bool Room::usesEncryption() const
 {
-    return !currentState()
-                .queryOr(&EncryptionEvent::algorithm, QString())
-                .isEmpty();
+    // The encryption event is in the room cache index, no need to load the rest
+    return !d->currentState.queryOr(&EncryptionEvent::algorithm, QString()).isEmpty();
 }
 
 RoomStateView Room::currentState() const
 {
+    d->loadPendingCachedState();
     return d->currentState;
 }
 
@@ -1547,21 +1835,16 @@ RoomEventPtr Room::decryptMessage(const EncryptedEvent& encryptedEvent)
                        << encryptedEvent.id() << "is not supported";
         return {};
     }
-    QString decrypted = d->groupSessionDecryptMessage(
-        encryptedEvent.ciphertext(), encryptedEvent.sessionId().toLatin1(),
-        encryptedEvent.id(), encryptedEvent.originTimestamp(),
-        encryptedEvent.senderId());
-    if (decrypted.isEmpty()) {
+    d->groupSession(encryptedEvent.sessionId().toLatin1());
+    const auto decrypted = d->groupSessionDecrypt(encryptedEvent);
+    d->evictGroupSessions();
+    if (!decrypted || decrypted->first.isEmpty()) {
         // qCWarning(E2EE) << "Encrypted message is empty";
         return {};
     }
-    auto decryptedEvent = encryptedEvent.createDecrypted(decrypted);
-    if (decryptedEvent->roomId() == id()) {
-        return decryptedEvent;
-    }
-    qWarning(E2EE) << "Decrypted event" << encryptedEvent.id()
-                   << "not for this room; discarding";
-    return {};
+    const auto indexIsFine = d->checkMessageIndex(encryptedEvent, decrypted->second);
+    d->saveMessageIndexRecords();
+    return indexIsFine ? d->makeDecrypted(encryptedEvent, decrypted->first) : nullptr;
 }
 
 void Room::handleRoomKeyEvent(const RoomKeyEvent& roomKeyEvent,
@@ -1569,34 +1852,83 @@ void Room::handleRoomKeyEvent(const RoomKeyEvent& roomKeyEvent,
                               const QByteArray& olmSessionId,
                               const QByteArray& senderKey,
                               const QByteArray& senderEdKey)
+{
+    if (d->addRoomKey(roomKeyEvent, senderId, olmSessionId, senderKey, senderEdKey))
+        d->retryDecryption({ roomKeyEvent.sessionId() });
+}
+
+void Room::handleRoomKeyEvents(const std::vector<ReceivedRoomKey>& roomKeys)
+{
+    QStringList newSessionIds;
+    for (const auto& k : roomKeys)
+        if (d->addRoomKey(*k.event, k.senderId, k.olmSessionId, k.senderKey, k.senderEdKey))
+            newSessionIds.push_back(k.event->sessionId());
+    if (!newSessionIds.isEmpty())
+        d->retryDecryption(newSessionIds);
+}
+
+bool Room::Private::addRoomKey(const RoomKeyEvent& roomKeyEvent, const QString& senderId,
+                               const QByteArray& olmSessionId, const QByteArray& senderKey,
+                               const QByteArray& senderEdKey)
 {
     if (roomKeyEvent.algorithm() != MegolmV1AesSha2AlgoKey) {
         qCWarning(E2EE) << "Ignoring unsupported algorithm"
                         << roomKeyEvent.algorithm() << "in m.room_key event";
     }
-    if (d->addInboundGroupSession(roomKeyEvent.sessionId().toLatin1(),
-                                  roomKeyEvent.sessionKey(), senderId,
-                                  olmSessionId, senderKey, senderEdKey)) {
-        qCWarning(E2EE) << "added new inboundGroupSession:"
-                        << d->groupSessions.size();
-        const auto undecryptedEvents =
-            d->undecryptedEvents[roomKeyEvent.sessionId()];
-        for (const auto& eventId : undecryptedEvents) {
-            const auto pIdx = d->eventsIndex.constFind(eventId);
-            if (pIdx == d->eventsIndex.cend())
+    if (!addInboundGroupSession(roomKeyEvent.sessionId().toLatin1(), roomKeyEvent.sessionKey(),
+                                senderId, olmSessionId, senderKey, senderEdKey))
+        return false;
+    qCWarning(E2EE) << "added new inboundGroupSession:" << knownGroupSessionIds.size();
+    return true;
+}
+
+void Room::Private::retryDecryption(const QStringList& sessionIds)
+{
+    // Events waiting for all the new sessions are decrypted in one go, and
+    // the timeline gets a single notification for the whole range on top of
+    // the per-event ones
+    std::vector<TimelineItem*> items;
+    std::vector<const EncryptedEvent*> encryptedEvents;
+    for (const auto& sessionId : sessionIds) {
+        const auto sessionIt = undecryptedEvents.find(sessionId);
+        if (sessionIt == undecryptedEvents.end())
+            continue;
+        for (const auto& eventId : std::as_const(sessionIt->second)) {
+            const auto pIdx = eventsIndex.constFind(eventId);
+            if (pIdx == eventsIndex.cend())
                 continue;
-            auto& ti = d->timeline[Timeline::size_type(*pIdx - minTimelineIndex())];
-            if (auto encryptedEvent = ti.viewAs<EncryptedEvent>()) {
-                if (auto decrypted = decryptMessage(*encryptedEvent)) {
-                    auto&& oldEvent = eventCast<EncryptedEvent>(
-                        ti.replaceEvent(std::move(decrypted)));
-                    ti->setOriginalEvent(std::move(oldEvent));
-                    emit replacedEvent(ti.event(), ti->originalEvent());
-                    d->undecryptedEvents[roomKeyEvent.sessionId()] -= eventId;
-                }
+            auto& ti = timeline.at(*pIdx);
+            if (const auto* encryptedEvent = ti.viewAs<EncryptedEvent>()) {
+                items.push_back(&ti);
+                encryptedEvents.push_back(encryptedEvent);
             }
         }
     }
+    if (encryptedEvents.empty())
+        return;
+
+    auto decryptedEvents = decryptEvents(encryptedEvents);
+    std::optional<std::pair<TimelineItem::index_t, TimelineItem::index_t>> replacedRange;
+    for (size_t i = 0; i < decryptedEvents.size(); ++i) {
+        if (!decryptedEvents[i])
+            continue;
+        auto& ti = *items[i];
+        const auto sessionIt = undecryptedEvents.find(encryptedEvents[i]->sessionId());
+        sessionIt->second.remove(ti->id());
+        if (sessionIt->second.isEmpty())
+            undecryptedEvents.erase(sessionIt);
+        auto&& oldEvent = eventCast<EncryptedEvent>(ti.replaceEvent(std::move(decryptedEvents[i])));
+        ti->setOriginalEvent(std::move(oldEvent));
+        updateEventCounters(ti);
+        emit q->replacedEvent(ti.event(), ti->originalEvent());
+        if (!replacedRange)
+            replacedRange.emplace(ti.index(), ti.index());
+        else
+            replacedRange = std::pair { std::min(replacedRange->first, ti.index()),
+                                        std::max(replacedRange->second, ti.index()) };
+    }
+    if (replacedRange)
+        emit q->replacedEvents(replacedRange->first, replacedRange->second);
 }
 
 int Room::joinedCount() const
@@ -1652,7 +1984,8 @@ void Room::Private::insertMemberIntoMap(const QString& memberId)
         auto otherMember = q->member(namesakes.front());
         emit q->memberNameAboutToUpdate(otherMember, otherMember.fullName());
     }
-    memberNameMap.insert(userName, memberId);
+    auto& stringPool = connection->stringPool();
+    memberNameMap.insert(stringPool.intern(userName), stringPool.intern(memberId));
     if (namesakes.size() == 1) {
         emit q->memberNameUpdated(q->member(namesakes.front()));
     }
@@ -1716,15 +2049,14 @@ Room::Private::moveEventsToTimeline(RoomEventsRange events,
     Q_ASSERT(!events.empty());
 
     const auto usesEncryption = q->usesEncryption();
+    const auto compactEvents = connection->compactEventStorage();
 
     // Historical messages arrive in newest-to-oldest order, so the process for
     // them is almost symmetric to the one for new messages. New messages get
     // appended from index 0; old messages go backwards from index -1.
-    auto index = timeline.empty()
-                     ? -((placement + 1) / 2) /* 1 -> -1; -1 -> 0 */
-                     : placement == Older ? timeline.front().index()
-                                          : timeline.back().index();
+    auto index = placement == Older ? timeline.firstIndex() : timeline.endIndex() - 1;
     auto baseIndex = index;
+    batchPushRuleContext = pushRuleContext();
     for (auto&& e : events) {
         Q_ASSERT_X(e, __FUNCTION__, "Attempt to add nullptr to timeline");
         const auto eId = e->id();
@@ -1735,10 +2067,13 @@ Room::Private::moveEventsToTimeline(RoomEventsRange events,
             !eventsIndex.contains(eId), __FUNCTION__,
             makeErrorStr(*e, "Event is already in the timeline; "
                              "incoming events were not properly deduplicated"));
-        const auto& ti = placement == Older
-                             ? timeline.emplace_front(std::move(e), --index)
-                             : timeline.emplace_back(std::move(e), ++index);
+        const auto& ti = placement == Older ? timeline.emplace_front(std::move(e))
+                                            : timeline.emplace_back(std::move(e));
+        index = ti.index();
         eventsIndex.insert(eId, index);
+        if (!readUsersAtUnloadedEvent.empty())
+            if (auto readUsers = readUsersAtUnloadedEvent.take(eId); !readUsers.isEmpty())
+                readUsersAtIndex.insert(index, std::move(readUsers));
         if (usesEncryption)
             if (auto* const rme = ti.viewAs<RoomMessageEvent>())
                 if (auto* const content = rme->content())
@@ -1747,10 +2082,15 @@ Room::Private::moveEventsToTimeline(RoomEventsRange events,
                                 &fileInfo->source))
                             FileMetadataMap::add(id, eId, *efm);
 
-        if (auto n = q->checkForNotifications(ti); n.type != Notification::None)
+        const auto n = q->checkForNotifications(ti);
+        if (n.type != Notification::None)
             notifications.insert(eId, n);
+        eventCounters.add(index, q->isEventNotable(ti), n.type == Notification::Highlight);
+        if (compactEvents)
+            ti->compactJson(&connection->stringPool());
         Q_ASSERT(q->findInTimeline(eId)->event()->id() == eId);
     }
+    batchPushRuleContext.reset();
     const auto insertedSize = (index - baseIndex) * placement;
     Q_ASSERT(insertedSize == int(events.size()));
     return Timeline::size_type(insertedSize);
@@ -1829,6 +2169,10 @@ Room::Changes Room::Private::updateStatsFromSyncData(const SyncRoomData& data,
 
 void Room::updateData(SyncRoomData&& data, bool fromCache)
 {
+    // Changes from the server should land on top of the complete room state
+    if (!fromCache)
+        d->loadPendingCachedState();
+
     qCDebug(MAIN) << "--- Updating room" << id() << "/" << objectName();
     bool firstUpdate = d->baseState.empty();
 
@@ -1840,7 +2184,11 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
     // The order of calculation is important - don't merge the lines!
     roomChanges |= d->updateStateFrom(std::move(data.state));
     roomChanges |= d->setSummary(std::move(data.summary));
+    const auto syncBatchStart = d->timeline.endIndex();
     roomChanges |= d->addNewMessageEvents(std::move(data.timeline));
+    if (connection()->maxResidentRoomEvents() >= 0 && !data.timelinePrevBatch.isEmpty()
+        && d->timeline.endIndex() > syncBatchStart)
+        d->historyTokens.insert_or_assign(syncBatchStart, data.timelinePrevBatch);
 
     for (auto&& ephemeralEvent : data.ephemeral)
         roomChanges |= processEphemeralEvent(std::move(ephemeralEvent));
@@ -1862,8 +2210,15 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
         // And now test for changes that can occur from /sync or otherwise
         d->postprocessChanges(roomChanges, !fromCache);
     }
+    if (fromCache) { // What's just been loaded from the cache is already there
+        d->unsavedStateKeys.clear();
+        d->unsavedAccountDataTypes.clear();
+        d->needsFullCacheWrite = false;
+        d->pendingCacheFileName = data.deferredCacheFileName;
+    }
     if (firstUpdate)
         emit baseStateLoaded();
+    d->unloadOldEvents();
     qCDebug(MAIN) << "--- Finished updating room" << id() << "/" << objectName();
 }
 
@@ -2331,6 +2686,8 @@ JobHandle<GetRoomEventsJob> Room::Private::getPreviousContent(int limit, const Q
         }
 
         auto [changes, from] = addHistoricalMessageEvents(eventsHistoryJob->chunk());
+        if (connection->maxResidentRoomEvents() >= 0 && prevBatch && from != historyEdge())
+            historyTokens.insert_or_assign(timeline.firstIndex(), *prevBatch);
         // The following condition will only trigger once, next time getPreviousContent()
         // will return without spawning GetRoomEventsJob
         if (!prevBatch)
@@ -2344,6 +2701,83 @@ JobHandle<GetRoomEventsJob> Room::Private::getPreviousContent(int limit, const Q
     return eventsHistoryJob;
 }
 
+void Room::Private::unloadOldEvents()
+{
+    const auto maxEvents = connection->maxResidentRoomEvents();
+    if (maxEvents < 0) {
+        historyTokens.clear(); // Only needed for unloading; it may have just been disabled
+        return;
+    }
+    // Unload in portions of at least a chunk, rather than after every sync
+    if (timeline.size() < size_t(maxEvents) + ChunkedTimeline::ChunkSize
+        || isJobPending(eventsHistoryJob))
+        return;
+
+    // Keep the events read markers point to, so that event statistics stay
+    // exact, as well as those displayed
+    auto keepFrom = timeline.endIndex() - maxEvents;
+    for (const auto& eventId : { fullyReadUntilEventId, q->lastLocalReadReceipt().eventId,
+                                 firstDisplayedEventId, lastDisplayedEventId })
+        if (const auto pIdx = eventsIndex.constFind(eventId); pIdx != eventsIndex.cend())
+            keepFrom = std::min(keepFrom, *pIdx);
+    // Only unload up to an event the history can be loaded back from
+    auto tokenIt = historyTokens.upper_bound(keepFrom);
+    if (tokenIt == historyTokens.begin())
+        return;
+    --tokenIt;
+    const auto unloadUpTo = tokenIt->first;
+    if (unloadUpTo <= timeline.firstIndex())
+        return;
+
+    QElapsedTimer et;
+    et.start();
+    const auto fromIndex = timeline.firstIndex();
+    emit q->aboutToUnloadMessages(fromIndex, unloadUpTo - 1);
+    for (auto index = fromIndex; index < unloadUpTo; ++index) {
+        auto& ti = timeline.at(index);
+        const auto eventId = ti->id();
+        if (auto readUsers = readUsersAtIndex.take(index); !readUsers.isEmpty())
+            readUsersAtUnloadedEvent.insert(eventId, std::move(readUsers));
+        notifications.remove(eventId);
+        if (const auto* encryptedEvent = ti.viewAs<EncryptedEvent>())
+            if (const auto sessionIt = undecryptedEvents.find(encryptedEvent->sessionId());
+                sessionIt != undecryptedEvents.end()) {
+                sessionIt->second.remove(eventId);
+                if (sessionIt->second.isEmpty())
+                    undecryptedEvents.erase(sessionIt);
+            }
+        if (const auto* reaction = ti.viewAs<ReactionEvent>()) {
+            const auto& content = reaction->content().value;
+            if (const auto relIt = relations.find({ content.eventId, content.type });
+                relIt != relations.end()) {
+                relIt->removeOne(reaction);
+                if (relIt->isEmpty())
+                    relations.erase(relIt);
+            }
+        }
+        eventsIndex.remove(eventId);
+        // The current state may refer to state events in the timeline; those
+        // become a part of the base state instead
+        if (ti->isStateEvent()
+            && currentState.get(ti->matrixType(), ti->stateKey()) == ti.event()) {
+            StateEventKey stateKey { ti->matrixType(), ti->stateKey() };
+            baseState[std::move(stateKey)].reset(
+                static_cast<StateEvent*>(ti.replaceEvent({}).release()));
+        }
+    }
+    timeline.unloadBefore(unloadUpTo);
+    eventCounters.unloadBefore(unloadUpTo);
+    historyTokens.erase(historyTokens.begin(), tokenIt);
+    const auto hadAllHistory = !prevBatch.has_value();
+    prevBatch = tokenIt->second;
+    qCDebug(MESSAGES).nospace() << "Unloaded events with indices [" << fromIndex << ","
+                                << unloadUpTo - 1 << "] from " << q->objectName() << " in "
+                                << et;
+    emit q->unloadedMessages(fromIndex, unloadUpTo - 1);
+    if (hadAllHistory)
+        emit q->allHistoryLoadedChanged();
+}
+
 void Room::inviteToRoom(const QString& memberId)
 {
     connection()->callApi<InviteUserJob>(id(), memberId);
@@ -2528,25 +2962,103 @@ void Room::Private::decryptIncomingEvents(RoomEvents& events)
     if (!q->usesEncryption())
         return; // If the room doesn't use encryption now, it never did
 
-    QElapsedTimer et;
-    et.start();
-    size_t totalDecrypted = 0;
+    std::vector<RoomEventPtr*> encryptedEventPtrs;
+    std::vector<const EncryptedEvent*> encryptedEvents;
     for (auto& eptr : events) {
         if (eptr->isRedacted())
             continue;
-        if (const auto& eeptr = eventCast<EncryptedEvent>(eptr)) {
-            if (auto decrypted = q->decryptMessage(*eeptr)) {
-                ++totalDecrypted;
-                auto&& oldEvent = eventCast<EncryptedEvent>(
-                        std::exchange(eptr, std::move(decrypted)));
-                eptr->setOriginalEvent(std::move(oldEvent));
-            } else
-                undecryptedEvents[eeptr->sessionId()] += eeptr->id();
+        if (const auto* ee = eventCast<EncryptedEvent>(eptr)) {
+            if (const auto algorithm = ee->algorithm(); !isSupportedAlgorithm(algorithm)) {
+                qWarning(E2EE) << "Algorithm" << algorithm << "of encrypted event" << ee->id()
+                               << "is not supported";
+                undecryptedEvents[ee->sessionId()] += ee->id();
+                continue;
+            }
+            encryptedEventPtrs.push_back(&eptr);
+            encryptedEvents.push_back(ee);
+        }
+    }
+    if (encryptedEvents.empty())
+        return;
+
+    auto decryptedEvents = decryptEvents(encryptedEvents);
+    for (size_t i = 0; i < decryptedEvents.size(); ++i) {
+        auto& eptr = *encryptedEventPtrs[i];
+        if (!decryptedEvents[i]) {
+            undecryptedEvents[encryptedEvents[i]->sessionId()] += encryptedEvents[i]->id();
+            continue;
         }
+        auto&& oldEvent =
+            eventCast<EncryptedEvent>(std::exchange(eptr, std::move(decryptedEvents[i])));
+        eptr->setOriginalEvent(std::move(oldEvent));
+    }
+}
+
+std::vector<RoomEventPtr> Room::Private::decryptEvents(
+    const std::vector<const EncryptedEvent*>& encryptedEvents)
+{
+    QElapsedTimer et;
+    et.start();
+
+    // Group encrypted events by megolm session: a session can only be used
+    // by one thread at a time, but different sessions can work in parallel
+    std::vector<std::optional<std::pair<QString, uint32_t>>> results(encryptedEvents.size());
+    std::vector<RoomEventPtr> decryptedEvents(encryptedEvents.size());
+    std::unordered_map<QString, std::vector<size_t>> sessionBatches;
+    for (size_t i = 0; i < encryptedEvents.size(); ++i)
+        sessionBatches[encryptedEvents[i]->sessionId()].push_back(i);
+
+    // Decrypting and parsing events doesn't need the database and can go to
+    // worker threads; the replay checks below need the database and are done
+    // on this thread, in the order of events
+    std::vector<const std::vector<size_t>*> batches;
+    batches.reserve(sessionBatches.size());
+    for (const auto& [sessionId, batch] : sessionBatches) {
+        // Load all sessions needed before going parallel; nothing is evicted
+        // until all the batches are decrypted
+        groupSession(sessionId.toLatin1());
+        batches.push_back(&batch);
+    }
+    const auto decryptBatch = [this, &batches, &encryptedEvents, &results,
+                               &decryptedEvents](size_t batchIndex) {
+        for (const auto i : *batches[batchIndex]) {
+            const auto& ee = *encryptedEvents[i];
+            results[i] = groupSessionDecrypt(ee);
+            if (results[i] && !results[i]->first.isEmpty())
+                decryptedEvents[i] = ee.createDecrypted(results[i]->first);
+        }
+    };
+    int threadsUsed = 1;
+    if (batches.size() > 1 && encryptedEvents.size() >= MinEventsForParallelDecryption)
+        threadsUsed = _impl::parallelFor(batches.size(), decryptBatch);
+    else
+        for (size_t i = 0; i < batches.size(); ++i)
+            decryptBatch(i);
+    QElapsedTimer checksEt;
+    checksEt.start();
+
+    size_t totalDecrypted = 0;
+    for (size_t i = 0; i < encryptedEvents.size(); ++i) {
+        auto& decryptedEvent = decryptedEvents[i];
+        if (!decryptedEvent)
+            continue;
+        const auto& ee = *encryptedEvents[i];
+        if (!checkMessageIndex(ee, results[i]->second))
+            decryptedEvent.reset();
+        else if (decryptedEvent->roomId() != id) {
+            qWarning(E2EE) << "Decrypted event" << ee.id() << "not for this room; discarding";
+            decryptedEvent.reset();
+        } else
+            ++totalDecrypted;
     }
+    saveMessageIndexRecords();
+    evictGroupSessions();
     if (totalDecrypted > 5 || et.nsecsElapsed() >= ProfilerMinNsecs)
-        qDebug(PROFILER)
-            << "Decrypted" << totalDecrypted << "events in" << et;
+        qDebug(PROFILER).nospace()
+            << "Decrypted " << totalDecrypted << " event(s) from " << batches.size()
+            << " session(s) in " << et << " (decryption in " << threadsUsed
+            << " thread(s), then replay checks in " << checksEt << ")";
+    return decryptedEvents;
 }
 
 //! \brief Make a redacted event
@@ -2617,7 +3129,7 @@ bool Room::Private::processRedaction(const RedactionEvent& redaction)
 
     Q_ASSERT(q->isValidIndex(*pIdx));
 
-    auto& ti = timeline[Timeline::size_type(*pIdx - q->minTimelineIndex())];
+    auto& ti = timeline.at(*pIdx);
     if (ti->isRedacted() && ti->redactedBecause()->id() == redaction.id()) {
         qCDebug(EVENTS) << "Redaction" << redaction.id() << "of event"
                         << ti->id() << "already done, skipping";
@@ -2629,6 +3141,7 @@ bool Room::Private::processRedaction(const RedactionEvent& redaction)
     // Make a new event from the redacted JSON and put it in the timeline
     // instead of the redacted one. oldEvent will be deleted on return.
     auto oldEvent = ti.replaceEvent(makeRedacted(*ti, redaction));
+    updateEventCounters(ti);
     qCDebug(EVENTS) << "Redacted" << oldEvent->id() << "with" << redaction.id();
     if (oldEvent->isStateEvent()) {
         // Check whether the old event was a part of current state; if it was,
@@ -2691,7 +3204,7 @@ bool Room::Private::processReplacement(const RoomMessageEvent& newEvent)
 
     Q_ASSERT(q->isValidIndex(*pIdx));
 
-    auto& ti = timeline[Timeline::size_type(*pIdx - q->minTimelineIndex())];
+    auto& ti = timeline.at(*pIdx);
     const auto* const rme = ti.viewAs<RoomMessageEvent>();
     if (!rme) {
         qCWarning(STATE) << "Ignoring attempt to replace a non-message event"
@@ -2707,6 +3220,7 @@ bool Room::Private::processReplacement(const RoomMessageEvent& newEvent)
     // Make a new event from the redacted JSON and put it in the timeline
     // instead of the redacted one. oldEvent will be deleted on return.
     auto oldEvent = ti.replaceEvent(makeReplaced(*ti, newEvent));
+    updateEventCounters(ti);
     qCDebug(STATE) << "Replaced" << oldEvent->id() << "with" << newEvent.id();
     emit q->replacedEvent(ti.event(), std::to_address(oldEvent));
     return true;
@@ -3047,7 +3561,15 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
 
     // Find a value (create an empty one if necessary) and get a reference
     // to it, anticipating a change further in the function.
-    auto& curStateEvent = d->currentState[{ e.matrixType(), e.stateKey() }];
+    StateEventKey stateKey{ e.matrixType(), e.stateKey() };
+    auto& curStateEvent = d->currentState[stateKey];
+    if (!d->needsFullCacheWrite) {
+        d->unsavedStateKeys.insert(std::move(stateKey));
+        if (d->unsavedStateKeys.size() > MaxUnsavedStateKeys) {
+            d->needsFullCacheWrite = true;
+            d->unsavedStateKeys.clear();
+        }
+    }
 
     d->preprocessStateEvent(e, curStateEvent);
 
@@ -3197,34 +3719,7 @@ Room::Changes Room::processEphemeralEvent(EventPtr&& event)
             // scattered across events (an anecdotal evidence showed 1.2-1.3
             // receipts per event on average).
             updatedUserIds.reserve(receiptsJson.size() * 2);
-            for (auto eventIt = receiptsJson.begin();
-                 eventIt != receiptsJson.end(); ++eventIt) {
-                const auto evtId = eventIt.key();
-                const auto newMarker = findInTimeline(evtId);
-                if (newMarker == historyEdge())
-                    qDebug(EPHEMERAL)
-                        << "Event" << evtId
-                        << "is not found; saving read receipt(s) anyway";
-                const auto reads =
-                    eventIt.value().toObject().value("m.read"_ls).toObject();
-                for (auto userIt = reads.begin(); userIt != reads.end();
-                     ++userIt) {
-                    ReadReceipt rr{ evtId,
-                                    fromJson<QDateTime>(
-                                        userIt->toObject().value("ts"_ls)) };
-                    const auto userId = userIt.key();
-                    if (userId == connection()->userId()) {
-                        // Local user is special, and will get a signal about
-                        // its read receipt separately from (and before) a
-                        // signal on everybody else. No particular reason, just
-                        // less cumbersome code.
-                        changes |= d->setLocalLastReadReceipt(newMarker, rr);
-                    } else if (d->setLastReadReceipt(userId, newMarker, rr)) {
-                        changes |= Change::Other;
-                        updatedUserIds.push_back(userId);
-                    }
-                }
-            }
+            changes |= d->applyReadReceipts(receiptsJson, updatedUserIds);
             if (updatedUserIds.size() > 10
                 || et.nsecsElapsed() >= ProfilerMinNsecs)
                 qDebug(PROFILER)
@@ -3254,6 +3749,8 @@ Room::Changes Room::processAccountDataEvent(EventPtr&& event)
     // efficient; maaybe do it another day
     if (!currentData || currentData->contentJson() != event->contentJson()) {
         emit accountDataAboutToChange(event->matrixType());
+        if (!d->needsFullCacheWrite)
+            d->unsavedAccountDataTypes.insert(event->matrixType());
         currentData = std::move(event);
         qCDebug(STATE) << "Updated account data of type"
                        << currentData->matrixType();
@@ -3333,7 +3830,7 @@ QString Room::Private::calculateDisplayname() const
         if (u.isEmpty() || isLocalMember(u))
             break;
         // Only disambiguate if the room is not empty
-        names.push_back(q->member(u).displayName());
+        names.push_back(RoomMember(q, currentState.get<RoomMemberEvent>(u)).displayName());
     }
 
     const auto usersCountExceptLocal =
@@ -3377,12 +3874,43 @@ void Room::Private::updateDisplayname()
     }
 }
 
+QJsonObject Room::Private::stateEventToCacheJson(const StateEvent& evt) const
+{
+    auto json = evt.fullJson();
+    auto unsignedJson = evt.unsignedJson();
+    unsignedJson.remove(QStringLiteral("prev_content"));
+    json[UnsignedKey] = unsignedJson;
+    return json;
+}
+
+void Room::Private::addCountersToJson(QJsonObject& json) const
+{
+    addParam<IfNotEmpty>(json, QStringLiteral("summary"), summary);
+    if (const auto& readReceipt = q->lastReadReceipt(connection->userId());
+        !readReceipt.eventId.isEmpty()) //
+    {
+        json.insert(
+            QStringLiteral("ephemeral"),
+            QJsonObject {
+                { QStringLiteral("events"),
+                  QJsonArray { ReceiptEvent({ { readReceipt.eventId,
+                                                { { connection->userId(),
+                                                    readReceipt.timestamp } } } })
+                                   .fullJson() } } });
+    }
+
+    json.insert(UnreadNotificationsKey,
+                QJsonObject { { PartiallyReadCountKey,
+                                countFromStats(partiallyReadStats) },
+                              { HighlightCountKey, serverHighlightCount } });
+    json.insert(NewUnreadCountKey, countFromStats(unreadStats));
+}
+
 QJsonObject Room::Private::toJson() const
 {
     QElapsedTimer et;
     et.start();
     QJsonObject result;
-    addParam<IfNotEmpty>(result, QStringLiteral("summary"), summary);
     {
         QJsonArray stateEvents;
 
@@ -3392,11 +3920,10 @@ QJsonObject Room::Private::toJson() const
                 || evt->contentJson().isEmpty())
                 continue;
 
-            auto json = evt->fullJson();
-            auto unsignedJson = evt->unsignedJson();
-            unsignedJson.remove(QStringLiteral("prev_content"));
-            json[UnsignedKey] = unsignedJson;
-            stateEvents.append(json);
+            stateEvents.append(stateEventToCacheJson(*evt));
+            if (connection->compactEventStorage())
+                // Don't keep the JSON unpacked just for the cache
+                evt->compactJson(&connection->stringPool());
         }
 
         const auto stateObjName = joinState == JoinState::Invite
@@ -3417,24 +3944,7 @@ QJsonObject Room::Private::toJson() const
                           { QStringLiteral("events"), accountDataEvents } });
     }
 
-    if (const auto& readReceipt = q->lastReadReceipt(connection->userId());
-        !readReceipt.eventId.isEmpty()) //
-    {
-        result.insert(
-            QStringLiteral("ephemeral"),
-            QJsonObject {
-                { QStringLiteral("events"),
-                  QJsonArray { ReceiptEvent({ { readReceipt.eventId,
-                                                { { connection->userId(),
-                                                    readReceipt.timestamp } } } })
-                                   .fullJson() } } });
-    }
-
-    result.insert(UnreadNotificationsKey,
-                  QJsonObject { { PartiallyReadCountKey,
-                                  countFromStats(partiallyReadStats) },
-                                { HighlightCountKey, serverHighlightCount } });
-    result.insert(NewUnreadCountKey, countFromStats(unreadStats));
+    addCountersToJson(result);
 
     if (et.elapsed() > 30)
         qCDebug(PROFILER) << "Room::toJson() for" << q->objectName() << "took"
@@ -3443,7 +3953,118 @@ QJsonObject Room::Private::toJson() const
     return result;
 }
 
-QJsonObject Room::toJson() const { return d->toJson(); }
+std::optional<QJsonObject> Room::Private::takeCacheDelta()
+{
+    const auto stateKeys = std::exchange(unsavedStateKeys, {});
+    const auto accountDataTypes = std::exchange(unsavedAccountDataTypes, {});
+    if (std::exchange(needsFullCacheWrite, false))
+        return std::nullopt;
+
+    // The delta has the same structure as toJson() output but only has state
+    // and account data events that changed; since the cache loader applies
+    // deltas in order on top of the full JSON, events with empty content are
+    // saved too, to override what has been there before
+    QJsonObject result;
+    if (!stateKeys.empty()) {
+        QJsonArray stateEvents;
+        for (const auto& [type, stateKey] : stateKeys)
+            if (const auto* evt = currentState.get(type, stateKey))
+                stateEvents.append(stateEventToCacheJson(*evt));
+        result.insert(joinState == JoinState::Invite ? QStringLiteral("invite_state")
+                                                     : QStringLiteral("state"),
+                      QJsonObject { { QStringLiteral("events"), stateEvents } });
+    }
+    if (!accountDataTypes.isEmpty()) {
+        QJsonArray accountDataEvents;
+        for (const auto& type : accountDataTypes)
+            if (const auto it = accountData.find(type); it != accountData.end())
+                accountDataEvents.append(it->second->fullJson());
+        result.insert(QStringLiteral("account_data"),
+                      QJsonObject { { QStringLiteral("events"), accountDataEvents } });
+    }
+    addCountersToJson(result);
+    return result;
+}
+
+QJsonObject Room::Private::toCacheIndexJson() const
+{
+    // Without heroes, the room display name needs all members, and then
+    // there's not much point in the index
+    if (!summary.heroes || summary.heroes->isEmpty())
+        return {};
+
+    // Only the state needed to show the room in the room list goes here
+    QJsonArray stateEvents;
+    const auto addEvent = [this, &stateEvents](const StateEvent* evt) {
+        if (evt && !evt->contentJson().isEmpty())
+            stateEvents.append(stateEventToCacheJson(*evt));
+    };
+    addEvent(currentState.get<RoomCreateEvent>());
+    addEvent(currentState.get<RoomNameEvent>());
+    addEvent(currentState.get<RoomCanonicalAliasEvent>());
+    addEvent(currentState.get<RoomAvatarEvent>());
+    addEvent(currentState.get<RoomTopicEvent>());
+    addEvent(currentState.get<RoomTombstoneEvent>());
+    addEvent(currentState.get<EncryptionEvent>());
+    addEvent(currentState.get<RoomMemberEvent>(connection->userId()));
+    for (const auto& userId : *summary.heroes)
+        addEvent(currentState.get<RoomMemberEvent>(userId));
+
+    QJsonObject result {
+        { joinState == JoinState::Invite ? QStringLiteral("invite_state")
+                                         : QStringLiteral("state"),
+          QJsonObject { { QStringLiteral("events"), stateEvents } } }
+    };
+    if (!accountData.empty()) {
+        QJsonArray accountDataEvents;
+        for (const auto& e : accountData)
+            if (!e.second->contentJson().isEmpty())
+                accountDataEvents.append(e.second->fullJson());
+        result.insert(QStringLiteral("account_data"),
+                      QJsonObject { { QStringLiteral("events"), accountDataEvents } });
+    }
+    addCountersToJson(result);
+    return result;
+}
+
+void Room::Private::loadPendingCachedState()
+{
+    if (pendingCacheFileName.isEmpty())
+        return;
+
+    QElapsedTimer et;
+    et.start();
+    auto roomJson = SyncData::loadRoomCache(std::exchange(pendingCacheFileName, {}));
+    if (roomJson.isEmpty()) {
+        qCWarning(MAIN) << "Could not load the cached state of" << q->objectName();
+        return;
+    }
+    // The counters in the room index are at least as fresh as those in the file
+    for (const auto& key : { QStringLiteral("summary"), QStringLiteral("ephemeral"),
+                             QString(UnreadNotificationsKey), QString(NewUnreadCountKey) })
+        roomJson.remove(key);
+
+    // Loading from the cache should not reset tracking of unsaved changes
+    auto stateKeys = std::exchange(unsavedStateKeys, {});
+    auto accountDataTypes = std::exchange(unsavedAccountDataTypes, {});
+    const auto fullCacheWrite = needsFullCacheWrite;
+    q->updateData(SyncRoomData(id, joinState, roomJson), true);
+    unsavedStateKeys = std::move(stateKeys);
+    unsavedAccountDataTypes = std::move(accountDataTypes);
+    needsFullCacheWrite = fullCacheWrite;
+    qCDebug(PROFILER) << "Deferred cached state for" << q->objectName() << "loaded in" << et;
+}
+
+QJsonObject Room::toJson() const
+{
+    // Make sure the cache file is not overwritten with the partial state
+    d->loadPendingCachedState();
+    return d->toJson();
+}
+
+std::optional<QJsonObject> Room::takeCacheDelta() { return d->takeCacheDelta(); }
+
+QJsonObject Room::toCacheIndexJson() const { return d->toCacheIndexJson(); }
 
 MemberSorter Room::memberSorter() const { return MemberSorter(); }
 
@@ -3458,23 +4079,20 @@ void Room::activateEncryption()
 
 void Room::addMegolmSessionFromBackup(const QByteArray& sessionId, const QByteArray& sessionKey, uint32_t index, const QByteArray& senderKey, const QByteArray& senderEdKey)
 {
-    const auto sessionIt = d->groupSessions.find(sessionId);
-    if (sessionIt != d->groupSessions.end() && sessionIt->second.firstKnownIndex() <= index)
+    if (const auto* existingSession = d->groupSession(sessionId);
+        existingSession && existingSession->firstKnownIndex() <= index)
         return;
 
     auto&& importResult = QOlmInboundGroupSession::importSession(sessionKey);
     if (!importResult)
         return;
-    // NB: after the next line, sessionIt can be invalid.
-    auto& session = d->groupSessions
-                        .insert_or_assign(sessionIt, sessionId,
-                                          std::move(importResult.value()))
-                        ->second;
+    auto& session = importResult.value();
     session.setOlmSessionId(d->connection->isVerifiedSession(sessionId)
                                 ? QByteArrayLiteral("BACKUP_VERIFIED")
                                 : QByteArrayLiteral("BACKUP"));
     session.setSenderId("BACKUP"_ls);
     d->connection->saveMegolmSession(this, session, senderKey, senderEdKey);
+    d->cacheGroupSession(sessionId, std::move(session));
 }
 
 void Room::startVerification()
@@ -3489,7 +4107,9 @@ void Room::startVerification()
 QJsonArray Room::exportMegolmSessions()
 {
     QJsonArray sessions;
-    for (auto& [key, value] : d->groupSessions) {
+    // Only some sessions are kept in memory, so load them all for the export
+    auto groupSessions = d->connection->loadRoomMegolmSessions(this);
+    for (auto& [key, value] : groupSessions) {
         auto session = value.exportSession(value.firstKnownIndex());
         if (!session.has_value()) {
             qCWarning(E2EE) << "Failed to export session" << session.error();
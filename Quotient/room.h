@@ -12,6 +12,7 @@
 #include "connection.h"
 #include "roommember.h"
 #include "roomstateview.h"
+#include "chunkedtimeline.h"
 #include "eventitem.h"
 #include "quotient_common.h"
 
@@ -28,7 +29,6 @@
 #include <QtCore/QJsonObject>
 #include <QtGui/QImage>
 
-#include <deque>
 #include <utility>
 
 namespace Quotient {
@@ -101,6 +101,15 @@ inline void swap(ReadReceipt& lhs, ReadReceipt& rhs)
 
 struct EventStats;
 
+//! An m.room_key event received over Olm, along with the data on its sender
+struct ReceivedRoomKey {
+    event_ptr_tt<RoomKeyEvent> event;
+    QString senderId;
+    QByteArray olmSessionId;
+    QByteArray senderKey;
+    QByteArray senderEdKey;
+};
+
 struct Notification
 {
     enum Type { None = 0, Basic, Highlight };
@@ -170,7 +179,7 @@ class QUOTIENT_API Room : public QObject {
     Q_PROPERTY(QStringList accountDataEventTypes READ accountDataEventTypes NOTIFY accountDataChanged)
 
 public:
-    using Timeline = std::deque<TimelineItem>;
+    using Timeline = ChunkedTimeline;
     using PendingEvents = std::vector<PendingEventItem>;
     using RelatedEvents = QVector<const RoomEvent*>;
     using rev_iter_t = Timeline::const_reverse_iterator;
@@ -268,6 +277,12 @@ public:
                             const QByteArray& olmSessionId,
                             const QByteArray& senderKey,
                             const QByteArray& senderEdKey);
+    //! \brief Add megolm sessions from several m.room_key events at once
+    //!
+    //! Unlike calling handleRoomKeyEvent() for each key, this retries
+    //! decryption of the events waiting for any of the new sessions only once,
+    //! after all sessions are added.
+    void handleRoomKeyEvents(const std::vector<ReceivedRoomKey>& roomKeys);
     int joinedCount() const;
     int invitedCount() const;
     int totalMemberCount() const;
@@ -471,6 +486,11 @@ public:
     //!   the original event usually is);
     //! - from a non-local user (events from other devices of the local
     //!   user are not notable).
+    //!
+    //! The room calls this when an event is added to the timeline and when it
+    //! gets redacted, edited or decrypted, and keeps the result to calculate
+    //! event statistics; overrides should therefore not depend on anything
+    //! else that can change over time.
     //! \sa partiallyReadStats, unreadStats
     virtual bool isEventNotable(const TimelineItem& ti) const;
 
@@ -810,6 +830,15 @@ Q_SIGNALS:
     void aboutToAddHistoricalMessages(Quotient::RoomEventsRange events);
     void aboutToAddNewMessages(Quotient::RoomEventsRange events);
     void addedMessages(int fromIndex, int toIndex);
+    //! \brief The oldest events are about to be unloaded from the timeline
+    //!
+    //! Events with timeline indices within [\p fromIndex, \p toIndex] will be
+    //! removed from the timeline to save memory; getPreviousContent() loads
+    //! them again.
+    //! \sa Connection::maxResidentRoomEvents
+    void aboutToUnloadMessages(int fromIndex, int toIndex);
+    //! The events within [\p fromIndex, \p toIndex] have been unloaded from the timeline
+    void unloadedMessages(int fromIndex, int toIndex);
     /// The event is about to be appended to the list of pending events
     void pendingEventAboutToAdd(Quotient::RoomEvent* event);
     /// An event has been appended to the list of pending events
@@ -922,6 +951,17 @@ Q_SIGNALS:
     void updatedEvent(QString eventId);
     void replacedEvent(const Quotient::RoomEvent* newEvent,
                        const Quotient::RoomEvent* oldEvent);
+    //! \brief Events in the timeline have been decrypted in a batch
+    //!
+    //! When room keys arrive, the events waiting for them are decrypted
+    //! together and this signal is emitted once for all of them, after
+    //! replacedEvent() has been emitted for each event; models that update
+    //! rows in bulk can use it instead of the latter. All replaced events
+    //! have their timeline indices (see TimelineItem::index()) within
+    //! [\p fromIndex, \p toIndex]; events between them may have been left
+    //! intact. Each replaced event has its encrypted original in
+    //! RoomEvent::originalEvent().
+    void replacedEvents(int fromIndex, int toIndex);
 
     void newFileTransfer(QString id, QUrl localFile);
     void fileTransferProgress(QString id, qint64 progress, qint64 total);
@@ -959,14 +999,32 @@ protected:
 
 private:
     friend class Connection;
+    friend struct EventStats;
 
     class Private;
     Private* d;
 
+    //! The numbers of notable and highlighted events in the timeline between
+    //! \p first and \p last indices, inclusive
+    std::pair<qsizetype, qsizetype> eventCounts(TimelineItem::index_t first,
+                                                TimelineItem::index_t last) const;
+
     // This is called from Connection, reflecting a state change that
     // arrived from the server. Clients should use
     // Connection::joinRoom() and Room::leaveRoom() to change the state.
     void setJoinState(JoinState state);
+
+    // This is called from Connection::saveRoomState() to get the room state
+    // changed since the previous call, in the same format as toJson() but only
+    // with state and account data events that changed. Returns std::nullopt
+    // if the changes haven't been tracked and the whole toJson() should be saved.
+    std::optional<QJsonObject> takeCacheDelta();
+
+    // This is called from Connection::saveState() to get the part of the room
+    // state needed to show the room before its cache file is loaded, in the
+    // same format as toJson(). Returns an empty object if the room should
+    // rather be loaded from its cache file right away.
+    QJsonObject toCacheIndexJson() const;
 };
 
 template <template <class> class ContT>
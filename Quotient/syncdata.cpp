@@ -4,9 +4,12 @@
 #include "syncdata.h"
 
 #include "logging_categories_p.h"
+#include "parallelfor_p.h"
 
 #include <QtCore/QFile>
 #include <QtCore/QFileInfo>
+#include <QtCore/QSemaphore>
+#include <QtCore/QThreadPool>
 
 #include <private/qjson_p.h>
 
@@ -145,9 +148,50 @@ QJsonObject loadJson(const QString& fileName)
     }
     return json;
 }
+
+void applyCacheJournal(QJsonObject& roomJson, const QString& journalFileName)
+{
+    QFile journalFile { journalFileName };
+    if (!journalFile.exists())
+        return;
+    if (!journalFile.open(QIODevice::ReadOnly)) {
+        qCWarning(MAIN) << "Failed to open state cache journal" << journalFileName;
+        return;
+    }
+    // Arrays of events are concatenated, everything else is replaced; collect
+    // the whole journal before merging it in to avoid copying arrays on each entry
+    static const std::array eventBatchKeys{ "state"_ls, "invite_state"_ls, "account_data"_ls };
+    QHash<QString, QJsonArray> newEvents;
+    QJsonObject newValues;
+    while (!journalFile.atEnd()) {
+        const auto delta = QJsonDocument::fromJson(journalFile.readLine()).object();
+        if (delta.isEmpty()) {
+            // Most likely, the client crashed while writing the last entry
+            qCWarning(MAIN) << "Broken entry in state cache journal" << journalFileName
+                            << "- ignoring the rest of it";
+            break;
+        }
+        for (auto it = delta.begin(); it != delta.end(); ++it)
+            if (std::ranges::find(eventBatchKeys, it.key()) != eventBatchKeys.cend()) {
+                auto& events = newEvents[it.key()];
+                for (const auto& e : it->toObject().value("events"_ls).toArray())
+                    events.append(e);
+            } else
+                newValues.insert(it.key(), *it);
+    }
+    for (auto it = newEvents.cbegin(); it != newEvents.cend(); ++it) {
+        auto events = roomJson.value(it.key()).toObject().value("events"_ls).toArray();
+        for (const auto& e : *it)
+            events.append(e);
+        roomJson.insert(it.key(), QJsonObject { { "events"_ls, events } });
+    }
+    for (auto it = newValues.begin(); it != newValues.end(); ++it)
+        roomJson.insert(it.key(), *it);
+}
 }
 
-SyncData::SyncData(const QString& cacheFileName)
+SyncData::SyncData(const QString& cacheFileName, bool lazyRooms)
+    : lazyRoomsFromCache(lazyRooms)
 {
     auto json = loadJson(cacheFileName);
     auto requiredVersion = MajorCacheVersion;
@@ -169,6 +213,19 @@ QString SyncData::fileNameForRoom(QString roomId)
     return roomId + ".json"_ls;
 }
 
+QString SyncData::journalFileName(const QString& roomCacheFileName)
+{
+    return roomCacheFileName + ".journal"_ls;
+}
+
+QJsonObject SyncData::loadRoomCache(const QString& roomCacheFileName)
+{
+    auto roomJson = loadJson(roomCacheFileName);
+    if (!roomJson.isEmpty())
+        applyCacheJournal(roomJson, journalFileName(roomCacheFileName));
+    return roomJson;
+}
+
 Events SyncData::takePresenceData() { return std::move(presenceData); }
 
 Events SyncData::takeAccountData() { return std::move(accountData); }
@@ -177,11 +234,35 @@ Events SyncData::takeToDeviceEvents() { return std::move(toDeviceEvents); }
 
 std::pair<int, int> SyncData::cacheVersion()
 {
-    return { MajorCacheVersion, 3 };
+    return { MajorCacheVersion, 4 };
 }
 
 DevicesList SyncData::takeDevicesList() { return std::move(devicesList); }
 
+void SyncData::setParallelParsing(bool enabled) { parallelParsing_ = enabled; }
+
+bool SyncData::parallelParsing() { return parallelParsing_; }
+
+namespace {
+//! A room to be turned into SyncRoomData, as found in the sync response or the cache index
+struct PendingRoom {
+    QString roomId;
+    JoinState joinState;
+    QJsonObject roomJson; //!< Empty if the room data is in a separate cache file
+    QString cacheFileName; //!< Only used when loading from the cache
+    QString deferredCacheFileName; //!< Only used when loading the room index from the cache
+};
+
+// Below this number of rooms the cost of dispatching to other threads outweighs the gain
+constexpr size_t MinRoomsForParallelParsing = 8;
+
+inline double toMsecs(qint64 nsecs)
+{
+    // NOLINTNEXTLINE(bugprone-integer-division)
+    return static_cast<double>(nsecs / 1000) / 1000;
+}
+}
+
 // FIXME, 0.9: baseDir -> cacheDir
 void SyncData::parseJson(const QJsonObject& json, const QString& baseDir)
 {
@@ -200,44 +281,383 @@ void SyncData::parseJson(const QJsonObject& json, const QString& baseDir)
         fromJson(json.value("device_lists"_ls), devicesList);
     }
 
-    auto rooms = json.value("rooms"_ls).toObject();
-    qsizetype totalRooms = 0;
-    size_t totalEvents = 0;
+    // Phase 1: collect rooms in the order they come in the JSON
+    const auto rooms = json.value("rooms"_ls).toObject();
+    std::vector<PendingRoom> pendingRooms;
     for (size_t i = 0; i < JoinStateStrings.size(); ++i) {
         // This assumes that MemberState values go over powers of 2: 1,2,4,...
         const auto joinState = JoinState(1U << i);
         const auto rs = rooms.value(JoinStateStrings[i]).toObject();
         // We have a Qt container on the right and an STL one on the left
-        roomData.reserve(roomData.size() + static_cast<size_t>(rs.size()));
+        pendingRooms.reserve(pendingRooms.size() + static_cast<size_t>(rs.size()));
         for (auto roomIt = rs.begin(); roomIt != rs.end(); ++roomIt) {
-            QJsonObject roomJson;
             // Normally (i.e. in a /sync response) the received JSON is
             // self-contained; but the local cache stores state for each room in
-            // its own file, loaded below
+            // its own file, loaded in the next phase
             if (Q_UNLIKELY(!baseDir.isEmpty())) {
-                roomJson = loadJson(
+                const auto roomRef = roomIt->toObject();
+                auto roomFileName =
                     baseDir
                     + (roomIt->isObject() // lib 0.8.1.2 onwards = cache 11.3 onwards
-                           ? roomIt->toObject().value("$ref"_ls).toString()
-                           : fileNameForRoom(roomIt.key()))); // lib pre-0.8.1.2 = cache pre-11.3
-                if (roomJson.isEmpty()) {
-                    unresolvedRoomIds.push_back(roomIt.key());
-                    continue;
-                }
+                           ? roomRef.value("$ref"_ls).toString()
+                           : fileNameForRoom(roomIt.key())); // lib pre-0.8.1.2 = cache pre-11.3
+                // The room index is there since lib 0.9 = cache 11.4
+                if (const auto roomIndex = roomRef.value("index"_ls).toObject();
+                    lazyRoomsFromCache && !roomIndex.isEmpty())
+                    pendingRooms.push_back(
+                        { roomIt.key(), joinState, roomIndex, {}, std::move(roomFileName) });
+                else
+                    pendingRooms.push_back({ roomIt.key(), joinState, {}, std::move(roomFileName) });
             } else // When loading from /sync response, everything is inline
-                roomJson = roomIt->toObject();
+                pendingRooms.push_back({ roomIt.key(), joinState, roomIt->toObject() });
+        }
+    }
+    const auto totalRooms = pendingRooms.size();
+    const auto collectingNsecs = et.nsecsElapsed();
+
+    // Phase 2: make SyncRoomData objects (this is where all room events are
+    // loaded), possibly in several threads; each result goes to the slot with
+    // the same index as its PendingRoom to keep the original order of rooms
+    std::vector<std::optional<SyncRoomData>> parsedRooms(totalRooms);
+    const auto parseRoom = [&pendingRooms, &parsedRooms](size_t i) {
+        const auto& pr = pendingRooms[i];
+        const auto roomJson = pr.cacheFileName.isEmpty() ? pr.roomJson
+                                                         : loadRoomCache(pr.cacheFileName);
+        if (!roomJson.isEmpty())
+            parsedRooms[i]
+                .emplace(pr.roomId, pr.joinState, roomJson)
+                .deferredCacheFileName = pr.deferredCacheFileName;
+    };
+    int threadsUsed = 1;
+    if (parallelParsing_ && totalRooms >= MinRoomsForParallelParsing)
+        threadsUsed = _impl::parallelFor(totalRooms, parseRoom);
+    else
+        for (size_t i = 0; i < totalRooms; ++i)
+            parseRoom(i);
+    const auto parsingNsecs = et.nsecsElapsed() - collectingNsecs;
 
-            roomData.emplace_back(roomIt.key(), joinState, roomJson);
-            const auto& r = roomData.back();
-            totalEvents += r.state.size() + r.ephemeral.size()
-                           + r.accountData.size() + r.timeline.size();
+    // Phase 3: move the results over to roomData, in the original order
+    roomData.reserve(roomData.size() + totalRooms);
+    size_t totalEvents = 0;
+    for (size_t i = 0; i < totalRooms; ++i) {
+        auto& r = parsedRooms[i];
+        if (!r) {
+            unresolvedRoomIds.push_back(pendingRooms[i].roomId);
+            continue;
         }
-        totalRooms += rs.size();
+        totalEvents += r->state.size() + r->ephemeral.size() + r->accountData.size()
+                       + r->timeline.size();
+        roomData.push_back(std::move(*r));
     }
     if (!unresolvedRoomIds.empty())
         qCWarning(MAIN) << "Unresolved rooms:" << unresolvedRoomIds.join(u',');
     if (totalRooms > 9 || et.nsecsElapsed() >= ProfilerMinNsecs)
-        qCDebug(PROFILER) << "*** SyncData::parseJson(): batch with"
-                          << totalRooms << "room(s)," << totalEvents
-                          << "event(s) in" << et;
+        qCDebug(PROFILER).nospace()
+            << "*** SyncData::parseJson(): batch with " << totalRooms << " room(s), "
+            << totalEvents << " event(s) in " << et << " (collecting rooms: "
+            << toMsecs(collectingNsecs) << "ms, parsing rooms: " << toMsecs(parsingNsecs)
+            << "ms in " << threadsUsed << " thread(s), merging: "
+            << toMsecs(et.nsecsElapsed() - collectingNsecs - parsingNsecs) << "ms)";
+}
+
+struct SyncDataStreamParser::RoomSlice {
+    QString roomId;
+    JoinState joinState;
+    QByteArray json;
+    std::atomic_bool taken = false; //!< Whoever sets it parses the room
+    QSemaphore parsed; //!< Released once the room is parsed by whoever has taken it
+    std::optional<SyncRoomData> result;
+    QString error;
+
+    //! Parse the room, unless someone else has taken it already
+    //! 
+eturn false if the room had been taken before
+    bool parse()
+    {
+        if (taken.exchange(true))
+            return false;
+        QJsonParseError parseError{};
+        const auto roomJson = QJsonDocument::fromJson(json, &parseError);
+        json = {}; // Release the bytes as early as possible
+        if (roomJson.isObject())
+            result.emplace(roomId, joinState, roomJson.object());
+        else
+            error = QStringLiteral("room %1 at %2: %3")
+                        .arg(roomId)
+                        .arg(parseError.offset)
+                        .arg(parseError.errorString());
+        parsed.release();
+        return true;
+    }
+};
+
+SyncDataStreamParser::~SyncDataStreamParser() { cancelRooms(); }
+
+void SyncDataStreamParser::cancelRooms()
+{
+    // The pool only has shared pointers to the rooms, so these can be left to it
+    for (const auto& slice : roomSlices)
+        slice->taken = true;
+}
+
+void SyncDataStreamParser::reset()
+{
+    cancelRooms();
+    *this = {};
+}
+
+bool SyncDataStreamParser::fail(QString message)
+{
+    cancelRooms(); // No need to parse the rest of them
+    error = std::move(message);
+    qCWarning(SYNCJOB) << "Failed to parse the sync response:" << error;
+    return false;
+}
+
+bool SyncDataStreamParser::tracksKeys() const
+{
+    // Only keys of the top-level object, of `rooms` and of `rooms.<join state>` matter
+    const auto depth = containers.size();
+    return depth == 1 || ((depth == 2 || depth == 3) && topLevelKey == "rooms"_ls);
+}
+
+void SyncDataStreamParser::onKey(const QString& key)
+{
+    switch (containers.size()) {
+    case 1:
+        topLevelKey = key;
+        break;
+    case 2: {
+        const auto it = std::ranges::find(JoinStateStrings, key);
+        joinState = it != JoinStateStrings.cend()
+                        // Same as in SyncData::parseJson(), this relies on JoinState
+                        // values going over powers of 2
+                        ? JoinState(1U << (it - JoinStateStrings.cbegin()))
+                        : JoinState::Invalid;
+        break;
+    }
+    case 3:
+        roomId = key;
+        break;
+    default:
+        Q_ASSERT(false); // tracksKeys() should have prevented this
+    }
+}
+
+void SyncDataStreamParser::onValueStart()
+{
+    // Capture the whole value of each top-level key except `rooms`, and each room under `rooms`;
+    // the rest is just walked through
+    const auto depth = containers.size();
+    if ((depth == 1 && topLevelKey != "rooms"_ls)
+        || (depth == 3 && topLevelKey == "rooms"_ls && joinState != JoinState::Invalid)) {
+        captureStart = pos + 1;
+        captureDepth = depth;
+    }
+}
+
+bool SyncDataStreamParser::onValueEnd()
+{
+    if (captureStart < 0 || containers.size() != captureDepth)
+        return true;
+
+    const auto valueBytes = buffer.sliced(captureStart, pos - captureStart).trimmed();
+    captureStart = -1;
+    QJsonParseError parseError{};
+    if (captureDepth == 1) {
+        // Wrap the value into an array as it may be a primitive that QJsonDocument won't parse
+        const auto arrayJson =
+            QJsonDocument::fromJson('[' + valueBytes + ']', &parseError).array();
+        if (parseError.error != QJsonParseError::NoError)
+            return fail(QStringLiteral("%1 at %2: %3")
+                            .arg(topLevelKey)
+                            .arg(parseError.offset)
+                            .arg(parseError.errorString()));
+        topLevelJson.insert(topLevelKey, arrayJson.first());
+        return true;
+    }
+    auto& slice = roomSlices.emplace_back(std::make_shared<RoomSlice>());
+    slice->roomId = roomId;
+    slice->joinState = joinState;
+    slice->json = valueBytes;
+    if (!SyncData::parallelParsing_)
+        slice->parse();
+    else
+        QThreadPool::globalInstance()->start([slice] { slice->parse(); });
+    return true;
+}
+
+namespace {
+QString decodeJsonString(QByteArrayView rawString)
+{
+    if (!rawString.contains('\\'))
+        return QString::fromUtf8(rawString);
+    // Let QJsonDocument deal with escape sequences; this is rare enough to not care about speed
+    return QJsonDocument::fromJson("[\"" + rawString.toByteArray() + "\"]")
+        .array()
+        .first()
+        .toString();
+}
+
+QString unexpectedAt(char c, qsizetype pos)
+{
+    return QStringLiteral("unexpected '%1' at byte %2").arg(QChar::fromLatin1(c)).arg(pos);
+}
+}
+
+bool SyncDataStreamParser::addData(QByteArrayView chunk)
+{
+    if (!error.isEmpty())
+        return false;
+    if (topLevelDone) {
+        if (!chunk.trimmed().isEmpty())
+            return fail(QStringLiteral("extra data after the end of the response"));
+        return true;
+    }
+
+    buffer.append(chunk);
+    for (; pos < buffer.size(); ++pos) {
+        const auto c = buffer[pos];
+        if (inString) {
+            if (escaped)
+                escaped = false;
+            else if (c == '\\')
+                escaped = true;
+            else if (c == '"') {
+                inString = false;
+                if (inKey) {
+                    inKey = false;
+                    expect = Expect::Colon;
+                    if (keyStart >= 0) {
+                        onKey(decodeJsonString(
+                            QByteArrayView(buffer).sliced(keyStart, pos - keyStart)));
+                        keyStart = -1;
+                    }
+                } else
+                    expect = Expect::CommaOrEnd;
+            }
+            continue;
+        }
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+            inPrimitive = false;
+            continue;
+        }
+        if (containers.empty() && c != '{')
+            return fail(QStringLiteral("the response is not a JSON object"));
+        const auto wasInPrimitive = std::exchange(inPrimitive, false);
+        const auto expectsValue = expect == Expect::Value || expect == Expect::ValueOrEnd;
+        switch (c) {
+        case '"':
+            if (expect == Expect::Key || expect == Expect::KeyOrEnd) {
+                inKey = true;
+                if (tracksKeys())
+                    keyStart = pos + 1;
+            } else if (!expectsValue)
+                return fail(unexpectedAt(c, pos));
+            inString = true;
+            break;
+        case '{':
+        case '[':
+            if (!expectsValue)
+                return fail(unexpectedAt(c, pos));
+            containers.push_back(c == '{' ? Container::Object : Container::Array);
+            expect = c == '{' ? Expect::KeyOrEnd : Expect::ValueOrEnd;
+            break;
+        case ':':
+            if (expect != Expect::Colon)
+                return fail(unexpectedAt(c, pos));
+            expect = Expect::Value;
+            onValueStart();
+            break;
+        case ',':
+            if (expect != Expect::CommaOrEnd)
+                return fail(unexpectedAt(c, pos));
+            if (!onValueEnd())
+                return false;
+            expect = containers.back() == Container::Object ? Expect::Key : Expect::Value;
+            break;
+        case '}':
+        case ']':
+            if (containers.back() != (c == '}' ? Container::Object : Container::Array)
+                || (expect != Expect::CommaOrEnd
+                    && expect != (c == '}' ? Expect::KeyOrEnd : Expect::ValueOrEnd)))
+                return fail(unexpectedAt(c, pos));
+            if (!onValueEnd()) // Either the last value in the container, or nothing
+                return false;
+            containers.pop_back();
+            expect = Expect::CommaOrEnd;
+            if (containers.empty()) {
+                topLevelDone = true;
+                const auto hasExtraData =
+                    !QByteArrayView(buffer).sliced(pos + 1).trimmed().isEmpty();
+                buffer.clear();
+                pos = 0;
+                if (hasExtraData)
+                    return fail(QStringLiteral("extra data after the end of the response"));
+                return true;
+            }
+            break;
+        default:
+            // A part of a number or a literal; these are only checked by QJsonDocument
+            // in the captured values
+            if (!expectsValue && !wasInPrimitive)
+                return fail(unexpectedAt(c, pos));
+            inPrimitive = true;
+            expect = Expect::CommaOrEnd;
+        }
+    }
+
+    // Drop the bytes that are no more needed; to keep the amount of memmove'ing
+    // under control, only do it when what's dropped is at least as big as what remains
+    const auto keepFrom = captureStart >= 0 ? captureStart : keyStart >= 0 ? keyStart : pos;
+    if (keepFrom > 0 && keepFrom >= buffer.size() - keepFrom) {
+        buffer.remove(0, keepFrom);
+        pos -= keepFrom;
+        if (captureStart >= 0)
+            captureStart -= keepFrom;
+        if (keyStart >= 0)
+            keyStart -= keepFrom;
+    }
+    return true;
+}
+
+bool SyncDataStreamParser::finish(SyncData& syncData)
+{
+    if (!error.isEmpty())
+        return false;
+    if (!topLevelDone)
+        return fail(QStringLiteral("the response is incomplete"));
+
+    QElapsedTimer et;
+    et.start();
+    // Parse the rooms that the thread pool hasn't got to yet, and wait for the rest
+    const auto totalRooms = roomSlices.size();
+    size_t parsedHere = 0;
+    for (const auto& slice : roomSlices) {
+        if (slice->parse())
+            ++parsedHere;
+        slice->parsed.acquire();
+    }
+    const auto waitingNsecs = et.nsecsElapsed();
+
+    for (const auto& slice : roomSlices)
+        if (!slice->error.isEmpty())
+            return fail(slice->error);
+    // Everything except rooms goes through the usual way
+    syncData.parseJson(topLevelJson);
+    // Put rooms in the same order as SyncData::parseJson() does: by join state
+    // (JoinState values follow JoinStateStrings), then by room id
+    std::ranges::stable_sort(roomSlices, [](const auto& lhs, const auto& rhs) {
+        return std::pair { lhs->joinState, lhs->roomId } < std::pair { rhs->joinState, rhs->roomId };
+    });
+    syncData.roomData.reserve(syncData.roomData.size() + totalRooms);
+    for (const auto& slice : roomSlices)
+        syncData.roomData.push_back(std::move(*slice->result));
+    if (totalRooms > 9 || et.nsecsElapsed() >= ProfilerMinNsecs)
+        qCDebug(PROFILER).nospace()
+            << "*** SyncDataStreamParser::finish(): " << totalRooms << " room(s), "
+            << parsedHere << " of them parsed in finish(), took " << et
+            << " (parsing or waiting for rooms: " << toMsecs(waitingNsecs) << "ms)";
+    reset();
+    return true;
 }
@@ -7,6 +7,8 @@
 
 #include "events/stateevent.h"
 
+#include <atomic>
+
 namespace Quotient {
 
 constexpr inline auto UnreadNotificationsKey = "unread_notifications"_ls;
@@ -73,6 +75,14 @@ public:
     std::optional<int> unreadCount;
     std::optional<int> highlightCount;
 
+    //! \brief The cache file with the rest of the room state
+    //!
+    //! This is only set when the room is loaded from the cache index (see
+    //! Connection::setLazyCacheLoading()); in that case the fields above only
+    //! have the part of the room state needed to show the room in the room
+    //! list, and the rest is loaded from this file when first needed.
+    QString deferredCacheFileName;
+
     SyncRoomData(QString roomId, JoinState joinState,
                  const QJsonObject& roomJson);
 };
@@ -83,7 +93,11 @@ using SyncDataList = std::vector<SyncRoomData>;
 class QUOTIENT_API SyncData {
 public:
     SyncData() = default;
-    explicit SyncData(const QString& cacheFileName);
+    //! \brief Load the top-level state cache, along with the room cache files
+    //! \param lazyRooms if true, only the room index from the top-level cache
+    //!                  is loaded for rooms that have it, and room cache files
+    //!                  are left for later (see SyncRoomData::deferredCacheFileName)
+    explicit SyncData(const QString& cacheFileName, bool lazyRooms = false);
     //! Parse sync response into room events
     //! \param json response from /sync or a room state cache
     void parseJson(const QJsonObject& json, const QString& baseDir = {});
@@ -102,11 +116,35 @@ public:
 
     QStringList unresolvedRooms() const { return unresolvedRoomIds; }
 
+    //! \brief Enable or disable parsing rooms of a single batch in parallel
+    //!
+    //! When enabled (the default), SyncRoomData objects for a batch with more than a few rooms
+    //! are constructed using QThreadPool::globalInstance(), with the calling thread taking part
+    //! as well. The order of rooms returned from takeRoomData() is the same either way.
+    static void setParallelParsing(bool enabled);
+    static bool parallelParsing();
+
     static constexpr int MajorCacheVersion = 11;
     static std::pair<int, int> cacheVersion();
     static QString fileNameForRoom(QString roomId);
+    //! \brief The name of the journal file for a given room cache file
+    //!
+    //! The journal stores changes made to the room state after the room cache
+    //! file has been written, one JSON object per line, in the same format as
+    //! the room cache file itself. When loading, these objects are applied in
+    //! order on top of the room cache file contents.
+    static QString journalFileName(const QString& roomCacheFileName);
+    //! \brief Load the room JSON from its cache file, with the journal applied
+    //! \return the room JSON; an empty object if the file is missing or broken
+    static QJsonObject loadRoomCache(const QString& roomCacheFileName);
 
 private:
+    friend class SyncDataStreamParser;
+
+    static inline std::atomic_bool parallelParsing_ = true;
+
+    bool lazyRoomsFromCache = false;
+
     QString nextBatch_;
     Events presenceData;
     Events accountData;
@@ -116,4 +154,70 @@ private:
     QHash<QString, int> deviceOneTimeKeysCount_;
     DevicesList devicesList;
 };
+
+//! \brief Incremental parser of /sync responses
+//!
+//! Unlike SyncData::parseJson() that needs the whole response as a QJsonObject, this class
+//! accepts the response body in arbitrary chunks, as they come from the network. On arrival,
+//! the chunks are only tokenised enough to cut the JSON of each room out of the response;
+//! the rest of the response (normally, much smaller than rooms) is parsed as soon as each
+//! top-level value is complete. Each room is turned into SyncRoomData as soon as its JSON
+//! is complete, and its bytes are released right after that. If SyncData::parallelParsing()
+//! allows, this is done in QThreadPool::globalInstance() so that addData() stays cheap enough
+//! to call from the thread receiving the data; finish() then waits for the rooms still being
+//! parsed, and parses those that haven't been picked by the pool yet itself. Either way,
+//! the raw bytes kept at any moment are those of the rooms waiting for a thread from the pool
+//! and of the incomplete room at the end of the received data.
+class QUOTIENT_API SyncDataStreamParser {
+public:
+    SyncDataStreamParser() = default;
+    ~SyncDataStreamParser();
+    SyncDataStreamParser(SyncDataStreamParser&&) = default;
+    SyncDataStreamParser& operator=(SyncDataStreamParser&&) = default;
+
+    //! Drop everything collected so far and get ready for a new response
+    void reset();
+
+    //! \brief Consume the next chunk of the response body
+    //! \return false if the data turned out to be malformed; see errorString() for details
+    bool addData(QByteArrayView chunk);
+
+    //! \brief Parse the collected rooms and move the results to \p syncData
+    //! \return false if the response was malformed or incomplete
+    bool finish(SyncData& syncData);
+
+    QString errorString() const { return error; }
+
+private:
+    enum class Container : char { Object, Array };
+    //! What can come next in the response, outside of strings
+    enum class Expect : char { Value, ValueOrEnd, Key, KeyOrEnd, Colon, CommaOrEnd };
+    struct RoomSlice;
+
+    QByteArray buffer;
+    qsizetype pos = 0; //!< The first byte in buffer that hasn't been scanned yet
+    std::vector<Container> containers;
+    Expect expect = Expect::Value;
+    bool inString = false;
+    bool inKey = false;
+    bool inPrimitive = false;
+    bool escaped = false;
+    bool topLevelDone = false;
+    qsizetype keyStart = -1;
+    qsizetype captureStart = -1;
+    size_t captureDepth = 0;
+    QString topLevelKey;
+    JoinState joinState = JoinState::Invalid;
+    QString roomId;
+    QJsonObject topLevelJson;
+    std::vector<std::shared_ptr<RoomSlice>> roomSlices;
+    QString error;
+
+    void cancelRooms();
+    bool tracksKeys() const;
+    void onKey(const QString& key);
+    void onValueStart();
+    bool onValueEnd();
+    bool fail(QString message);
+};
 } // namespace Quotient
@@ -134,6 +134,16 @@ bool Quotient::isGuestUserId(const UserId& uId)
     return guestMxIdRe.match(uId).hasMatch();
 }
 
+QString Quotient::StringPool::intern(const QString& s)
+{
+    if (s.isEmpty())
+        return {};
+    if (const auto it = strings.constFind(s); it != strings.cend())
+        return *it;
+    strings.insert(s);
+    return s;
+}
+
 bool Quotient::HomeserverData::checkMatrixSpecVersion(QStringView targetVersion) const
 {
     // TODO: Replace this naïve implementation with something smarter that can check things like
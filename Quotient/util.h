@@ -10,6 +10,7 @@
 #include <QtCore/QElapsedTimer>
 #include <QtCore/QHashFunctions>
 #include <QtCore/QLatin1String>
+#include <QtCore/QSet>
 #include <QtCore/QUrl>
 
 #include <memory>
@@ -450,4 +451,23 @@ struct QUOTIENT_API HomeserverData {
 
     bool checkMatrixSpecVersion(QStringView targetVersion) const;
 };
+
+//! \brief A pool of strings sharing storage between equal strings
+//!
+//! intern() returns the same string object (in the sense of implicit sharing)
+//! for equal strings; keeping many copies of a string obtained from the pool
+//! costs no extra memory, and comparing such copies is cheap because QString
+//! doesn't compare the contents when the data are shared. Strings are never
+//! removed from the pool, so it is only good for a limited set of values
+//! that repeat a lot, such as user ids, event types or state keys.
+//! \note The pool is not thread-safe
+class QUOTIENT_API StringPool {
+public:
+    //! Get the string from the pool equal to \p s, adding \p s if needed
+    QString intern(const QString& s);
+    qsizetype size() const { return strings.size(); }
+
+private:
+    QSet<QString> strings;
+};
 } // namespace Quotient
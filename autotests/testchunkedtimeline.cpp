@@ -0,0 +1,91 @@
+// SPDX-FileCopyrightText: 2026 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <Quotient/chunkedtimeline.h>
+#include <Quotient/events/roommessageevent.h>
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class TestChunkedTimeline : public QObject {
+    Q_OBJECT
+
+private Q_SLOTS:
+    void addAtBothEnds();
+    void iterators();
+    void unloadChunks();
+};
+
+namespace {
+RoomEventPtr messageEvent(int n)
+{
+    return makeEvent<RoomMessageEvent>(QString::number(n));
+}
+} // namespace
+
+void TestChunkedTimeline::addAtBothEnds()
+{
+    ChunkedTimeline timeline;
+    QVERIFY(timeline.empty());
+    for (int n = 0; n < 1000; ++n)
+        QCOMPARE(timeline.emplace_back(messageEvent(n)).index(), n);
+    const auto* const firstItem = &timeline.front();
+    for (int n = -1; n >= -700; --n)
+        QCOMPARE(timeline.emplace_front(messageEvent(n)).index(), n);
+    QCOMPARE(&std::as_const(timeline).at(0), firstItem); // Items never move
+    QCOMPARE(timeline.size(), size_t(1700));
+    QCOMPARE(timeline.firstIndex(), -700);
+    QCOMPARE(timeline.endIndex(), 1000);
+    QCOMPARE(timeline.front().index(), -700);
+    QCOMPARE(timeline.back().index(), 999);
+    QCOMPARE(timeline[0].index(), -700);
+    for (int n = -700; n < 1000; ++n)
+        QCOMPARE(timeline.at(n).viewAs<RoomMessageEvent>()->plainBody(), QString::number(n));
+}
+
+void TestChunkedTimeline::iterators()
+{
+    ChunkedTimeline timeline;
+    for (int n = 0; n < 300; ++n)
+        timeline.emplace_back(messageEvent(n));
+    const auto oldBegin = timeline.cbegin();
+    for (int n = -1; n >= -300; --n)
+        timeline.emplace_front(messageEvent(n));
+    QCOMPARE(oldBegin->index(), 0); // Iterators stay valid
+    QCOMPARE(timeline.cend() - timeline.cbegin(), std::ptrdiff_t(600));
+    QCOMPARE(timeline.crbegin()->index(), 299);
+    QCOMPARE((timeline.crend() - 1)->index(), -300);
+    const auto it = std::find_if(timeline.cbegin(), timeline.cend(),
+                                 [](const TimelineItem& ti) { return ti.index() == 5; });
+    QCOMPARE(it - timeline.cbegin(), std::ptrdiff_t(305));
+    QVERIFY(ChunkedTimeline::const_reverse_iterator(it) > timeline.crbegin());
+    QVERIFY(timeline.rend() == timeline.crend());
+    int expected = -300;
+    for (const auto& ti : std::as_const(timeline))
+        QCOMPARE(ti.index(), expected++);
+}
+
+void TestChunkedTimeline::unloadChunks()
+{
+    ChunkedTimeline timeline;
+    for (int n = 0; n < 1000; ++n)
+        timeline.emplace_back(messageEvent(n));
+    QCOMPARE(timeline.unloadBefore(0), size_t(0));
+    QCOMPARE(timeline.unloadBefore(ChunkedTimeline::ChunkSize * 2 + 10),
+             size_t(ChunkedTimeline::ChunkSize * 2 + 10));
+    QCOMPARE(timeline.firstIndex(), ChunkedTimeline::ChunkSize * 2 + 10);
+    QCOMPARE(timeline.at(600).viewAs<RoomMessageEvent>()->plainBody(), QString::number(600));
+    // Items added to the front again get the same indices
+    for (int n = ChunkedTimeline::ChunkSize * 2 + 9; n >= ChunkedTimeline::ChunkSize; --n)
+        QCOMPARE(timeline.emplace_front(messageEvent(n)).index(), n);
+    QCOMPARE(timeline.size(), size_t(1000 - ChunkedTimeline::ChunkSize));
+    // Unloading everything keeps the indexing
+    QCOMPARE(timeline.unloadBefore(5000), size_t(1000 - ChunkedTimeline::ChunkSize));
+    QVERIFY(timeline.empty());
+    QCOMPARE(timeline.emplace_back(messageEvent(1000)).index(), 1000);
+    QCOMPARE(timeline.emplace_front(messageEvent(999)).index(), 999);
+}
+
+QTEST_APPLESS_MAIN(TestChunkedTimeline)
+#include "testchunkedtimeline.moc"
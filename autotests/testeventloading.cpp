@@ -0,0 +1,135 @@
+// SPDX-FileCopyrightText: 2026 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <Quotient/events/callevents.h>
+#include <Quotient/events/encryptedevent.h>
+#include <Quotient/events/keyverificationevent.h>
+#include <Quotient/events/reactionevent.h>
+#include <Quotient/events/receiptevent.h>
+#include <Quotient/events/redactionevent.h>
+#include <Quotient/events/roommemberevent.h>
+#include <Quotient/events/roommessageevent.h>
+#include <Quotient/events/simplestateevents.h>
+#include <Quotient/events/typingevent.h>
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class TestEventLoading : public QObject {
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void sameTypesAsTraversal();
+    void benchmarkLoading_data();
+    void benchmarkLoading();
+
+private:
+    QVector<QJsonObject> syncEvents;
+};
+
+namespace {
+QJsonObject makeEvent(const QString& type, const QJsonObject& content, int n,
+                      std::optional<QString> stateKey = std::nullopt)
+{
+    QJsonObject json { { TypeKey, type },
+                       { ContentKey, content },
+                       { EventIdKey, QStringLiteral("$event%1:example.org").arg(n) },
+                       { SenderKey, QStringLiteral("@user%1:example.org").arg(n % 50) },
+                       { "origin_server_ts"_ls, 1700000000000 + n } };
+    if (stateKey)
+        json.insert(StateKeyKey, *stateKey);
+    return json;
+}
+} // namespace
+
+void TestEventLoading::initTestCase()
+{
+    // A mix of events resembling what an initial sync of a few busy rooms
+    // brings: mostly messages, member events and reactions, with some other
+    // state, redactions, calls and typing notifications, and a few unknown types
+    const QJsonObject textContent { { "msgtype"_ls, "m.text"_ls }, { "body"_ls, "Hello"_ls } };
+    const QJsonObject annotation {
+        { RelatesToKey, QJsonObject { { "rel_type"_ls, "m.annotation"_ls },
+                                      { EventIdKey, "$event1:example.org"_ls },
+                                      { "key"_ls, QStringLiteral("👍") } } }
+    };
+    for (int n = 0; n < 1000; ++n) {
+        switch (n % 20) {
+        case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7:
+            syncEvents.push_back(makeEvent("m.room.message"_ls, textContent, n));
+            break;
+        case 8: case 9: case 10: case 11:
+            syncEvents.push_back(makeEvent("m.room.member"_ls, { { "membership"_ls, "join"_ls } },
+                                           n, QStringLiteral("@user%1:example.org").arg(n)));
+            break;
+        case 12: case 13:
+            syncEvents.push_back(makeEvent("m.reaction"_ls, annotation, n));
+            break;
+        case 14: // Not a proper annotation, should end up as a generic RoomEvent
+            syncEvents.push_back(makeEvent("m.reaction"_ls, {}, n));
+            break;
+        case 15:
+            syncEvents.push_back(makeEvent("m.room.name"_ls, { { "name"_ls, "Room"_ls } }, n, QString()));
+            break;
+        case 16: // No state key, so not a state event
+            syncEvents.push_back(makeEvent("m.room.topic"_ls, { { "topic"_ls, "Topic"_ls } }, n));
+            break;
+        case 17:
+            syncEvents.push_back(makeEvent("org.example.custom.state"_ls, {}, n, QString()));
+            break;
+        case 18:
+            syncEvents.push_back(makeEvent("org.example.custom"_ls, {}, n));
+            break;
+        case 19:
+            syncEvents.push_back(makeEvent("m.room.redaction"_ls, {}, n));
+            syncEvents.push_back(Event::basicJson("m.typing"_ls, { { "user_ids"_ls, QJsonArray() } }));
+            syncEvents.push_back(makeEvent("m.call.invite"_ls, { { "call_id"_ls, "1"_ls } }, n));
+            break;
+        }
+    }
+}
+
+void TestEventLoading::sameTypesAsTraversal()
+{
+    const auto checkBase = [this]<EventClass EventT>(std::type_identity<EventT>) {
+        for (const auto& json : std::as_const(syncEvents)) {
+            const auto type = json[TypeKey].toString();
+            const auto& metaType = mostSpecificMetaType<EventT>();
+            const auto fromTable = metaType.loadFrom(json, type);
+            const auto fromTraversal = metaType.loadByTraversal(json, type);
+            QCOMPARE(bool(fromTable), bool(fromTraversal));
+            if (fromTable)
+                QCOMPARE(fromTable->metaType().className, fromTraversal->metaType().className);
+        }
+    };
+    checkBase(std::type_identity<Event>());
+    checkBase(std::type_identity<RoomEvent>());
+    checkBase(std::type_identity<StateEvent>());
+    checkBase(std::type_identity<RoomMemberEvent>());
+}
+
+void TestEventLoading::benchmarkLoading_data()
+{
+    QTest::addColumn<bool>("useTraversal");
+    QTest::newRow("dispatch table") << false;
+    QTest::newRow("traversal") << true;
+}
+
+void TestEventLoading::benchmarkLoading()
+{
+    QFETCH(bool, useTraversal);
+    const auto& metaType = mostSpecificMetaType<RoomEvent>();
+    QBENCHMARK {
+        for (const auto& json : std::as_const(syncEvents)) {
+            const auto type = json[TypeKey].toString();
+            const auto event = useTraversal ? metaType.loadByTraversal(json, type)
+                                            : metaType.loadFrom(json, type);
+            QVERIFY(event);
+        }
+    }
+}
+
+QTEST_APPLESS_MAIN(TestEventLoading)
+#include "testeventloading.moc"
@@ -0,0 +1,246 @@
+// SPDX-FileCopyrightText: 2026 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <Quotient/pushruleevaluator.h>
+
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class TestPushRules : public QObject {
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void evaluate_data();
+    void evaluate();
+    void disabledRules();
+    void benchmarkEvaluation();
+
+private:
+    std::optional<PushRuleEvaluator> evaluator;
+    PushRuleEvaluator::RoomContext context;
+};
+
+namespace {
+// A subset of the server-default push rules, with a room and a sender rule on top
+const auto PushRulesJson = R"({ "global": {
+  "override": [
+    { "rule_id": ".m.rule.master", "default": true, "enabled": false, "actions": [],
+      "conditions": [] },
+    { "rule_id": ".m.rule.suppress_notices", "default": true, "enabled": true, "actions": [],
+      "conditions": [
+        { "kind": "event_match", "key": "content.msgtype", "pattern": "m.notice" } ] },
+    { "rule_id": ".m.rule.invite_for_me", "default": true, "enabled": true,
+      "actions": [ "notify", { "set_tweak": "sound", "value": "default" } ],
+      "conditions": [
+        { "kind": "event_match", "key": "type", "pattern": "m.room.member" },
+        { "kind": "event_match", "key": "content.membership", "pattern": "invite" },
+        { "kind": "event_match", "key": "state_key", "pattern": "@me:example.org" } ] },
+    { "rule_id": ".m.rule.member_event", "default": true, "enabled": true, "actions": [],
+      "conditions": [ { "kind": "event_match", "key": "type", "pattern": "m.room.member" } ] },
+    { "rule_id": ".m.rule.is_user_mention", "default": true, "enabled": true,
+      "actions": [ "notify", { "set_tweak": "highlight" } ],
+      "conditions": [ { "kind": "event_property_contains", "key": "content.m\\.mentions.user_ids",
+                        "value": "@me:example.org" } ] },
+    { "rule_id": ".m.rule.contains_display_name", "default": true, "enabled": true,
+      "actions": [ "notify", { "set_tweak": "highlight" } ],
+      "conditions": [ { "kind": "contains_display_name" } ] },
+    { "rule_id": ".m.rule.roomnotif", "default": true, "enabled": true,
+      "actions": [ "notify", { "set_tweak": "highlight" } ],
+      "conditions": [
+        { "kind": "event_match", "key": "content.body", "pattern": "@room" },
+        { "kind": "sender_notification_permission", "key": "room" } ] },
+    { "rule_id": ".m.rule.suppress_edits", "default": true, "enabled": true, "actions": [],
+      "conditions": [ { "kind": "event_property_is", "key": "content.m\\.relates_to.rel_type",
+                        "value": "m.replace" } ] }
+  ],
+  "content": [
+    { "rule_id": ".m.rule.contains_user_name", "default": true, "enabled": true,
+      "actions": [ "notify", { "set_tweak": "highlight" } ], "pattern": "me" },
+    { "rule_id": "wildcard", "default": false, "enabled": true,
+      "actions": [ "notify", { "set_tweak": "highlight", "value": false } ],
+      "pattern": "quo?ient*" }
+  ],
+  "room": [
+    { "rule_id": "!muted:example.org", "default": false, "enabled": true, "actions": [] }
+  ],
+  "sender": [
+    { "rule_id": "@friend:example.org", "default": false, "enabled": true,
+      "actions": [ "notify", { "set_tweak": "highlight" } ] }
+  ],
+  "underride": [
+    { "rule_id": ".m.rule.room_one_to_one", "default": true, "enabled": true,
+      "actions": [ "notify", { "set_tweak": "highlight", "value": false } ],
+      "conditions": [
+        { "kind": "room_member_count", "is": "2" },
+        { "kind": "event_match", "key": "type", "pattern": "m.room.message" } ] },
+    { "rule_id": ".m.rule.message", "default": true, "enabled": true,
+      "actions": [ "notify" ],
+      "conditions": [ { "kind": "event_match", "key": "type", "pattern": "m.room.message" } ] },
+    { "rule_id": ".m.rule.unknown", "default": true, "enabled": true, "actions": [ "notify" ],
+      "conditions": [ { "kind": "org.example.unknown" } ] }
+  ]
+} })";
+
+QJsonObject messageJson(const QString& body, const QString& sender = "@user:example.org"_ls,
+                        const QJsonObject& extraContent = {})
+{
+    QJsonObject content { { "msgtype"_ls, "m.text"_ls }, { "body"_ls, body } };
+    for (auto it = extraContent.begin(); it != extraContent.end(); ++it)
+        content.insert(it.key(), it.value());
+    return { { TypeKey, "m.room.message"_ls },
+             { EventIdKey, "$event:example.org"_ls },
+             { SenderKey, sender },
+             { ContentKey, content } };
+}
+} // namespace
+
+void TestPushRules::initTestCase()
+{
+    evaluator.emplace(PushRuleEvaluator::fromAccountData(
+        QJsonDocument::fromJson(QByteArray(PushRulesJson)).object()));
+    context = { "!room:example.org"_ls, "@me:example.org"_ls, "My Name"_ls, 5,
+                [](const QString& senderId, const QString& key) {
+                    return key == "room"_ls && senderId == "@admin:example.org"_ls;
+                } };
+}
+
+void TestPushRules::evaluate_data()
+{
+    QTest::addColumn<QJsonObject>("eventJson");
+    QTest::addColumn<QString>("roomId");
+    QTest::addColumn<int>("memberCount");
+    QTest::addColumn<bool>("notify");
+    QTest::addColumn<bool>("highlight");
+
+    const QString room = "!room:example.org"_ls;
+    const QString mutedRoom = "!muted:example.org"_ls;
+    const QJsonObject mentions { { "user_ids"_ls, QJsonArray { "@me:example.org"_ls } } };
+    QTest::newRow("plain message") << messageJson("Hello"_ls) << room << 5 << true << false;
+    QTest::newRow("one-to-one") << messageJson("Hello"_ls) << room << 2 << true << false;
+    QTest::newRow("notice") << QJsonObject { { TypeKey, "m.room.message"_ls },
+                                             { SenderKey, "@user:example.org"_ls },
+                                             { ContentKey,
+                                               QJsonObject { { "msgtype"_ls, "m.notice"_ls },
+                                                             { "body"_ls, "me"_ls } } } }
+                            << room << 5 << false << false;
+    QTest::newRow("user name as a word") << messageJson("Ping ME, please"_ls) << room << 5
+                                         << true << true;
+    QTest::newRow("user name in a word") << messageJson("Some message"_ls) << room << 5 << true
+                                         << false;
+    QTest::newRow("display name") << messageJson("Hi, my name!"_ls) << room << 5 << true << true;
+    QTest::newRow("display name in a word")
+        << messageJson("Hi, my names"_ls) << room << 5 << true << false;
+    QTest::newRow("wildcard content rule")
+        << messageJson("Quotient rocks"_ls) << room << 5 << true << false;
+    QTest::newRow("mention")
+        << messageJson("Hello"_ls, "@user:example.org"_ls, { { "m.mentions"_ls, mentions } })
+        << room << 5 << true << true;
+    QTest::newRow("edit") << messageJson("Ping me"_ls, "@user:example.org"_ls,
+                                         { { "m.relates_to"_ls,
+                                             QJsonObject { { "rel_type"_ls, "m.replace"_ls } } } })
+                          << room << 5 << false << false;
+    QTest::newRow("@room from a user") << messageJson("@room hi"_ls) << room << 5 << true << false;
+    QTest::newRow("@room from an admin")
+        << messageJson("@room hi"_ls, "@admin:example.org"_ls) << room << 5 << true << true;
+    QTest::newRow("muted room") << messageJson("Hello"_ls) << mutedRoom << 5 << false << false;
+    QTest::newRow("muted room, user name")
+        << messageJson("Hello me"_ls) << mutedRoom << 5 << true << true;
+    QTest::newRow("sender rule") << messageJson("Hello"_ls, "@friend:example.org"_ls) << room
+                                 << 5 << true << true;
+    QTest::newRow("invite") << QJsonObject { { TypeKey, "m.room.member"_ls },
+                                             { SenderKey, "@user:example.org"_ls },
+                                             { StateKeyKey, "@me:example.org"_ls },
+                                             { ContentKey,
+                                               QJsonObject { { "membership"_ls, "invite"_ls } } } }
+                            << room << 5 << true << false;
+    QTest::newRow("other member event")
+        << QJsonObject { { TypeKey, "m.room.member"_ls },
+                         { SenderKey, "@user:example.org"_ls },
+                         { StateKeyKey, "@user:example.org"_ls },
+                         { ContentKey, QJsonObject { { "membership"_ls, "join"_ls } } } }
+        << room << 5 << false << false;
+    QTest::newRow("unknown event type")
+        << QJsonObject { { TypeKey, "org.example.custom"_ls },
+                         { SenderKey, "@user:example.org"_ls },
+                         { ContentKey, QJsonObject() } }
+        << room << 5 << false << false;
+}
+
+void TestPushRules::evaluate()
+{
+    QFETCH(QJsonObject, eventJson);
+    QFETCH(QString, roomId);
+    QFETCH(int, memberCount);
+    QFETCH(bool, notify);
+    QFETCH(bool, highlight);
+
+    const auto event = loadEvent<RoomEvent>(eventJson);
+    QVERIFY(event);
+    auto roomContext = context;
+    roomContext.roomId = roomId;
+    roomContext.memberCount = memberCount;
+    const auto actions = evaluator->evaluate(*event, roomContext);
+    QCOMPARE(actions.notify, notify);
+    QCOMPARE(actions.highlight, highlight);
+}
+
+void TestPushRules::disabledRules()
+{
+    auto rulesJson = QJsonDocument::fromJson(QByteArray(PushRulesJson)).object();
+    auto global = rulesJson["global"_ls].toObject();
+    auto overrideRules = global["override"_ls].toArray();
+    auto masterRule = overrideRules[0].toObject();
+    masterRule["enabled"_ls] = true;
+    overrideRules[0] = masterRule;
+    global["override"_ls] = overrideRules;
+    rulesJson["global"_ls] = global;
+
+    const auto masterEvaluator = PushRuleEvaluator::fromAccountData(rulesJson);
+    const auto event = loadEvent<RoomEvent>(messageJson("Hello me"_ls));
+    QVERIFY(!masterEvaluator.evaluate(*event, context).notify);
+    QVERIFY(evaluator->evaluate(*event, context).notify);
+}
+
+void TestPushRules::benchmarkEvaluation()
+{
+    // Mostly plain messages, with some mentioning the user, edits and member events
+    std::vector<RoomEventPtr> events;
+    events.reserve(100'000);
+    for (int n = 0; n < 100'000; ++n) {
+        switch (n % 10) {
+        case 0:
+            events.push_back(loadEvent<RoomEvent>(
+                messageJson("Hey me, have a look at message %1"_ls.arg(n))));
+            break;
+        case 1:
+            events.push_back(loadEvent<RoomEvent>(QJsonObject {
+                { TypeKey, "m.room.member"_ls },
+                { SenderKey, "@user%1:example.org"_ls.arg(n) },
+                { StateKeyKey, "@user%1:example.org"_ls.arg(n) },
+                { ContentKey, QJsonObject { { "membership"_ls, "join"_ls } } } }));
+            break;
+        case 2:
+            events.push_back(loadEvent<RoomEvent>(messageJson(
+                "Edited message"_ls, "@user:example.org"_ls,
+                { { "m.relates_to"_ls, QJsonObject { { "rel_type"_ls, "m.replace"_ls } } } })));
+            break;
+        default:
+            events.push_back(loadEvent<RoomEvent>(
+                messageJson("Just a regular message number %1 in the room"_ls.arg(n))));
+        }
+    }
+    int notifications = 0;
+    QBENCHMARK {
+        notifications = 0;
+        for (const auto& e : events)
+            notifications += evaluator->evaluate(*e, context).notify;
+    }
+    QCOMPARE(notifications, 80'000);
+}
+
+QTEST_APPLESS_MAIN(TestPushRules)
+#include "testpushrules.moc"
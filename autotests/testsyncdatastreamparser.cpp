@@ -0,0 +1,248 @@
+// SPDX-FileCopyrightText: 2026 Quotient contributors
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include <Quotient/syncdata.h>
+
+#include <QtCore/QRandomGenerator>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class TestSyncDataStreamParser : public QObject {
+    Q_OBJECT
+
+private Q_SLOTS:
+    void cleanup();
+    void sameAsParseJson_data();
+    void sameAsParseJson();
+    void malformed_data();
+    void malformed();
+    void reuseAfterFailure();
+};
+
+namespace {
+QJsonArray eventsJson(const auto& events)
+{
+    QJsonArray result;
+    for (const auto& e : events)
+        result.append(e->fullJson());
+    return result;
+}
+
+//! Turn everything SyncData has into JSON, to compare the results in one go
+QJsonObject dump(SyncData& syncData)
+{
+    QJsonArray rooms;
+    for (const auto& r : syncData.takeRoomData())
+        rooms.append(QJsonObject {
+            { "id"_ls, r.roomId },
+            { "join_state"_ls, int(r.joinState) },
+            { "state"_ls, eventsJson(r.state) },
+            { "timeline"_ls, eventsJson(r.timeline) },
+            { "ephemeral"_ls, eventsJson(r.ephemeral) },
+            { "account_data"_ls, eventsJson(r.accountData) },
+            { "limited"_ls, r.timelineLimited },
+            { "prev_batch"_ls, r.timelinePrevBatch },
+            { "joined"_ls, r.summary.joinedMemberCount.value_or(-1) },
+            { "highlights"_ls, r.highlightCount.value_or(-1) },
+        });
+    QJsonObject keyCounts;
+    for (auto it = syncData.deviceOneTimeKeysCount().cbegin();
+         it != syncData.deviceOneTimeKeysCount().cend(); ++it)
+        keyCounts.insert(it.key(), it.value());
+    const auto devices = syncData.takeDevicesList();
+    return { { "next_batch"_ls, syncData.nextBatch() },
+             { "presence"_ls, eventsJson(syncData.takePresenceData()) },
+             { "account_data"_ls, eventsJson(syncData.takeAccountData()) },
+             { "to_device"_ls, eventsJson(syncData.takeToDeviceEvents()) },
+             { "key_counts"_ls, keyCounts },
+             { "devices_changed"_ls, QJsonArray::fromStringList(devices.changed) },
+             { "devices_left"_ls, QJsonArray::fromStringList(devices.left) },
+             { "rooms"_ls, rooms } };
+}
+
+QByteArray message(int n, const QString& body)
+{
+    return QJsonDocument(QJsonObject {
+                             { TypeKey, "m.room.message"_ls },
+                             { EventIdKey, QStringLiteral("$ev%1:example.org").arg(n) },
+                             { SenderKey, "@alice:example.org"_ls },
+                             { "origin_server_ts"_ls, 1700000000000 + n },
+                             { ContentKey, QJsonObject { { "msgtype"_ls, "m.text"_ls },
+                                                         { BodyKey, body } } } })
+        .toJson(QJsonDocument::Compact);
+}
+
+//! Feed \p data to \p parser in chunks of the sizes returned by \p nextSize
+bool feed(SyncDataStreamParser& parser, QByteArrayView data, const auto& nextSize)
+{
+    for (qsizetype i = 0; i < data.size();) {
+        const auto size = std::min(nextSize(), data.size() - i);
+        if (!parser.addData(data.sliced(i, size)))
+            return false;
+        i += size;
+    }
+    return true;
+}
+
+// Chunking modes: 0 - the whole response at once, 1 - byte by byte, other - random sizes
+// from 1 to the mode number, with a fixed seed to make failures reproducible
+constexpr std::array ChunkingModes { 0, 1, 3, 17, 256 };
+
+bool parseStreamed(const QByteArray& data, int chunking, SyncData& syncData,
+                   QString* errorString = nullptr)
+{
+    SyncDataStreamParser parser;
+    QRandomGenerator rng(quint32(chunking));
+    const auto ok =
+        feed(parser, data,
+             [&]() -> qsizetype {
+                 return chunking == 0 ? data.size()
+                        : chunking == 1 ? 1
+                                        : rng.bounded(1, chunking + 1);
+             })
+        && parser.finish(syncData);
+    if (errorString)
+        *errorString = parser.errorString();
+    return ok;
+}
+} // namespace
+
+void TestSyncDataStreamParser::cleanup() { SyncData::setParallelParsing(true); }
+
+void TestSyncDataStreamParser::sameAsParseJson_data()
+{
+    QTest::addColumn<QByteArray>("response");
+    QTest::addColumn<bool>("parallel");
+
+    // Keys and strings with escape sequences, including escaped quotes, backslashes and
+    // brackets that a splitter would trip over if it looked into strings
+    const auto tricky = message(1, QStringLiteral("quote \" brace } bracket ] backslash \\ \"}{\"\\\\"));
+    QByteArray rooms = R"("rooms":{"join":{"!plain:example.org":{"timeline":{"events":[)"
+                       + message(2, QStringLiteral("hello")) + "," + tricky
+                       + R"(],"limited":true,"prev_batch":"p\"1"},"summary":{"m.joined_member_count":3},)"
+                         R"("unread_notifications":{"highlight_count":2}},)"
+                         R"("!esc\u0061ped\u003aexample.org":{"state":{"events":[{"type":"m.room.name",)"
+                         R"("state_key":"","event_id":"$n:example.org","sender":"@bob:example.org",)"
+                         R"("origin_server_ts":1,"content":{"name":"Näme 😀"}}]}}},)"
+                         R"("invite":{"!inv:example.org":{"invite_state":{"events":[]}}},)"
+                         R"("leave":{"!left:example.org":{"timeline":{"events":[)"
+                       + message(3, QStringLiteral("bye")) + R"(]}}},"unknown_state":{"!x:y":{"a":[1,{"b":"}"}]}}})";
+    for (int i = 4; i < 40; ++i) // Enough rooms to get some parsed in the thread pool
+        rooms.insert(rooms.indexOf(R"("!plain)"),
+                     QStringLiteral(R"("!r%1:example.org":{"timeline":{"events":[%2]}},)")
+                         .arg(i)
+                         .arg(QString::fromUtf8(message(i, QString::number(i))))
+                         .toUtf8());
+
+    const QByteArray responses[][2] {
+        { "full",
+          R"( {"next_batch":"s72595_4483_1934","presence":{"events":[{"type":"m.presence",)"
+          R"("sender":"@carol:example.org","content":{"presence":"online"}}]},)"
+          R"("account_data":{"events":[{"type":"org.example.custom","content":{"k":"v\\"}}]},)"
+          R"("to_device":{"events":[]},"device_one_time_keys_count":{"signed_curve25519":50},)"
+          R"("device_lists":{"changed":["@dave:example.org"],"left":[]},)"
+          + rooms + "}\r\n" },
+        { "primitive top-level values",
+          R"({"next_batch":"s1","device_unused_fallback_key_types":null,"flag":true,)"
+          R"("number":-12.5e-3,"empty_object":{},"empty_array":[],)"
+          + rooms + R"(,"last":false})" },
+        { "rooms first", "{" + rooms + R"(,"next_\u0062atch":"\"s2\\"})" },
+        { "no rooms", R"({"next_batch":"s3"})" },
+        { "empty rooms", R"({"rooms":{"join":{},"leave":{}},"next_batch":"s4"})" },
+        { "empty", "{}" },
+    };
+    for (const auto& [name, response] : responses)
+        for (const auto parallel : { false, true })
+            QTest::addRow("%s, %s", name.constData(), parallel ? "parallel" : "sequential")
+                << response << parallel;
+}
+
+void TestSyncDataStreamParser::sameAsParseJson()
+{
+    QFETCH(QByteArray, response);
+    QFETCH(bool, parallel);
+    SyncData::setParallelParsing(parallel);
+
+    QJsonParseError parseError{};
+    const auto json = QJsonDocument::fromJson(response, &parseError);
+    QCOMPARE(parseError.error, QJsonParseError::NoError);
+    SyncData expected;
+    expected.parseJson(json.object());
+    const auto expectedDump = dump(expected);
+
+    for (const auto chunking : ChunkingModes) {
+        SyncData actual;
+        QString errorString;
+        QVERIFY2(parseStreamed(response, chunking, actual, &errorString),
+                 qPrintable(QStringLiteral("chunking %1: %2").arg(chunking).arg(errorString)));
+        QCOMPARE(dump(actual), expectedDump);
+    }
+}
+
+void TestSyncDataStreamParser::malformed_data()
+{
+    QTest::addColumn<QByteArray>("response");
+
+    QTest::newRow("empty") << QByteArray();
+    QTest::newRow("whitespace only") << QByteArray(" \n");
+    QTest::newRow("array") << QByteArray(R"([{"next_batch":"s1"}])");
+    QTest::newRow("string") << QByteArray(R"("next_batch")");
+    QTest::newRow("garbage before") << QByteArray(R"(x{"next_batch":"s1"})");
+    QTest::newRow("truncated in a key") << QByteArray(R"({"next_ba)");
+    QTest::newRow("truncated in an escape") << QByteArray(R"({"next_batch":"s1\)");
+    QTest::newRow("truncated in a room")
+        << QByteArray(R"({"rooms":{"join":{"!r:x":{"timeline":{"events":[)");
+    QTest::newRow("truncated after the last value") << QByteArray(R"({"next_batch":"s1")");
+    QTest::newRow("trailing garbage") << QByteArray(R"({"next_batch":"s1"}x)");
+    QTest::newRow("trailing object") << QByteArray(R"({"next_batch":"s1"} {})");
+    QTest::newRow("extra closing brace") << QByteArray(R"({"next_batch":"s1"}})");
+    QTest::newRow("mismatched brackets") << QByteArray(R"({"a":{"b":1]})");
+    QTest::newRow("missing colon") << QByteArray(R"({"next_batch" "s1"})");
+    QTest::newRow("missing comma") << QByteArray(R"({"a":1 "b":2})");
+    QTest::newRow("double comma") << QByteArray(R"({"a":1,,"b":2})");
+    QTest::newRow("trailing comma") << QByteArray(R"({"a":1,})");
+    QTest::newRow("bad literal") << QByteArray(R"({"a":tru})");
+    QTest::newRow("bad top-level value") << QByteArray(R"({"presence":{"events":[1,]}})");
+    QTest::newRow("bad room")
+        << QByteArray(R"({"rooms":{"join":{"!r:x":{"timeline":{"events":[nul]}}}}})");
+    QTest::newRow("bad escape in a room")
+        << QByteArray(R"({"rooms":{"join":{"!r:x":{"a":"\x"}}}})");
+}
+
+void TestSyncDataStreamParser::malformed()
+{
+    QFETCH(QByteArray, response);
+    QJsonParseError parseError{};
+    const auto json = QJsonDocument::fromJson(response, &parseError);
+    QVERIFY(parseError.error != QJsonParseError::NoError || !json.isObject());
+
+    for (const auto parallel : { false, true }) {
+        SyncData::setParallelParsing(parallel);
+        for (const auto chunking : ChunkingModes) {
+            SyncData syncData;
+            QString errorString;
+            QVERIFY2(!parseStreamed(response, chunking, syncData, &errorString),
+                     qPrintable(QStringLiteral("chunking %1").arg(chunking)));
+            QVERIFY(!errorString.isEmpty());
+            QVERIFY(syncData.takeRoomData().empty());
+        }
+    }
+}
+
+void TestSyncDataStreamParser::reuseAfterFailure()
+{
+    SyncDataStreamParser parser;
+    QVERIFY(!parser.addData(R"({"rooms":{"join":{"!r:x":{}}}}})"));
+    QVERIFY(!parser.errorString().isEmpty());
+    parser.reset();
+    QVERIFY(parser.errorString().isEmpty());
+    QVERIFY(parser.addData(R"({"next_batch":"s1","rooms":{"join":{"!r:x":{}}}})"));
+    SyncData syncData;
+    QVERIFY(parser.finish(syncData));
+    QCOMPARE(syncData.nextBatch(), QStringLiteral("s1"));
+    QCOMPARE(syncData.takeRoomData().size(), size_t(1));
+}
+
+QTEST_GUILESS_MAIN(TestSyncDataStreamParser)
+#include "testsyncdatastreamparser.moc"